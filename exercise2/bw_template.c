@@ -31,45 +31,226 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <infiniband/verbs.h>
+#include <linux/mempolicy.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define WC_BATCH (10)
-#define MAX_INLINE_SIZE (220) // 256 - 36
+#define MAX_INLINE_SIZE (220) // 256 - 36, requested by default
 
 enum {
   BANDWIDTH_RECV_WRID = 1,
   BANDWIDTH_SEND_WRID = 2,
+  BANDWIDTH_READ_WRID = 3, // reads and atomics, both carry a response
+  BANDWIDTH_CTRL_WRID = 4, // sends and credits, not part of the measurement
+};
+
+// the low 32 bits of a send wr_id hold the type above, the high 32 bits the
+// number of send wrs retired by its completion (itself plus the unsignaled
+// wrs posted before it)
+#define BW_WRID(type, n) ((uint64_t)(n) << 32 | (type))
+#define BW_SEND_WRID(n) BW_WRID(BANDWIDTH_SEND_WRID, n)
+#define BW_CTRL_WRID BW_WRID(BANDWIDTH_CTRL_WRID, 1)
+#define BW_WRID_COUNT(wr_id) ((int)((wr_id) >> 32))
+
+// In bidir mode the immediate data of both directions meets on one qp, credits
+// for our own writes are marked with this bit.
+#define BW_IMM_CREDIT 0x80000000u
+
+enum bw_op {
+  BW_OP_WRITE,
+  BW_OP_READ,
+  BW_OP_FADD, // 8-byte fetch-and-add of 1
+  BW_OP_CAS,  // 8-byte compare-and-swap
+  BW_OP_SEND, // two-sided, into the server's receive ring
+  BW_OP_RING, // one-sided records into a ring the server polls
+  BW_OP_KV,   // hash table GETs by rdma read, PUTs by send
+};
+
+static const char *bw_op_names[] = {"write", "read", "fadd", "cas", "send",
+                                    "ring", "kv"};
+
+// --gather: how a message of scattered fragments goes out, every size and
+// fragment count runs all of them in this order
+enum bw_gather {
+  BW_GATHER_SGE,   // one write, the HCA gathers one sge per fragment
+  BW_GATHER_COPY,  // memcpy into a staging slot, one write of that
+  BW_GATHER_SPLIT, // one write per fragment
+  BW_GATHER_MODES
+};
+
+static const char *bw_gather_names[] = {"sge", "copy", "split"};
+
+#define BW_GATHER_MAX 64 // fragments per message
+
+// Atomic target words sit on their own cache line of the peer's bigbuf, so
+// spreading over more words also spreads over more lines.
+#define BW_ATOMIC_STRIDE 64
+
+// Log-linear latency histogram in ns: values below BW_HIST_SUB have a bucket
+// each, above that every power of two is split into BW_HIST_SUB linear
+// buckets, i.e. about 3% resolution up to 2^BW_HIST_MAX_BITS ns (~18 min).
+#define BW_HIST_SUB_BITS (5)
+#define BW_HIST_SUB (1 << BW_HIST_SUB_BITS)
+#define BW_HIST_MAX_BITS (40)
+#define BW_HIST_BUCKETS ((BW_HIST_MAX_BITS - BW_HIST_SUB_BITS + 1) * BW_HIST_SUB)
+
+struct bw_hist {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[BW_HIST_BUCKETS];
+};
+
+enum bw_poll_mode {
+  BW_POLL_BUSY,   // spin on the cqs
+  BW_POLL_EVENT,  // sleep on the completion channel whenever idle
+  BW_POLL_HYBRID, // spin for poll_budget usec, then sleep
+};
+
+static const char *bw_poll_names[] = {"busy", "event", "hybrid"};
+
+// backing memory of bigbuf
+enum bw_mem {
+  BW_MEM_4K,  // posix_memalign on normal pages
+  BW_MEM_2M,  // MAP_HUGETLB 2MB pages, from vm.nr_hugepages
+  BW_MEM_1G,  // MAP_HUGETLB 1GB pages
+  BW_MEM_ODP, // normal pages registered with IBV_ACCESS_ON_DEMAND
+  BW_MEM_NUM,
+};
+
+static const char *bw_mem_names[BW_MEM_NUM] = {"4k", "2m", "1g", "odp"};
+
+// verbs used to post and poll
+enum bw_engine {
+  BW_ENGINE_LEGACY, // ibv_post_send/ibv_poll_cq
+  BW_ENGINE_EX,     // ibv_qp_ex ibv_wr_*, ibv_cq_ex ibv_start_poll
+};
+
+// how results are written
+enum bw_format {
+  BW_FMT_TEXT, // tab-separated lines
+  BW_FMT_JSON, // the parameters and one object per reported step
+  BW_FMT_CSV,  // the parameters as comments, a header and one row per step
 };
 
 static int page_size;
+static FILE *bw_info; // setup lines, kept off stdout for json and csv
+
+struct bandwidth_qp {
+  struct ibv_cq *cq; // every qp polls its own cq
+  struct ibv_qp *qp;
+  struct ibv_comp_channel *channel; // of the worker owning the qp, or NULL
+  int armed;                        // cq notification requested
+  long polled;                      // cqes reaped
+  int routs;          // outstanding recv wr num
+  int sq_outstanding; // posted send wrs whose slot is not yet retired
+  int unsignaled;     // send wrs posted since the last signaled one
+  long imm_received;  // sum of the immediate data received, in host order
+  long imm_used;      // server: part of imm_received already accounted
+  long credits;       // bidir: BW_IMM_CREDIT immediate data received
+  long credits_used;  // bidir: part of credits already accounted
+  long recvs;         // recv completions
+  long recvs_used;    // server: recv completions already answered
+  long reads_done;    // rdma reads completed
+  long verified;      // --verify: received messages checked
+  long corrupt;       // --verify: checked messages with a bad crc32c
+  uint64_t verify_bytes; // --verify: bytes checked
+  uint64_t verify_ns;    // --verify: time spent checking
+  uint32_t ring_seq;  // --op=ring: last record written, or consumed
+  uint32_t ring_base; // --op=ring: ring_seq when the step started
+  uint32_t ring_acked; // --op=ring server: last head written back
+  long sq_posted;     // send wrs posted in total
+  uint64_t *post_ns;  // post time of the last hist_ring send wrs, 0: ctrl
+  int hist_ring;      // max_send_wr, more can't be outstanding
+  struct bw_hist *hist; // per-wr latency goes here, NULL if not measured
+  struct ibv_cq_ex *cq_ex; // extended engine, cq is its ibv_cq
+  struct ibv_qp_ex *qpx;   // extended engine
+  // with hardware completion timestamps: device clock in kHz, and the
+  // context its clock is read from at post time; 0/NULL otherwise
+  uint64_t ts_khz;
+  struct ibv_context *ts_context;
+};
+
+// Writes are linked into a list of up to batch wrs that is handed to the
+// HCA with a single ibv_post_send, i.e. one doorbell per batch. The wrs form
+// a ring of templates prepared once: sg_list, num_sge, lkey and the next
+// links never change, per write only the addresses and flags are filled in.
+// Each wr owns max_send_sge sges; only --gather uses more than the first.
+struct bw_chain {
+  struct ibv_send_wr *wr;
+  struct ibv_sge *sge; // batch * max_sge
+  int max_sge;
+  int batch;        // wrs per ibv_post_send
+  int signal_every; // request a cqe for every signal_every-th wr
+  int len;          // wrs linked so far
+  int send_flags;   // IBV_SEND_INLINE if the current size fits inline
+};
 
 struct bandwidth_context {
   struct ibv_context *context;
-  struct ibv_comp_channel *channel;
+  struct ibv_comp_channel **channels; // one per worker in event modes
+  int num_channels;
   struct ibv_pd *pd;
   struct ibv_mr *mr;
-  struct ibv_mr *bigmr; // mr for data
-  struct ibv_cq *cq;
-  struct ibv_qp *qp;
+  struct ibv_mr *bigmr; // mr for data, shared by all qps
+  struct bandwidth_qp *qps;
+  int num_qps;
+  struct ibv_srq *srq; // if set, it backs all qps and each worker's qps
+                       // share one cq
+  int *qpn_index;      // qp_num -> index into qps, for shared cqs
+  int qpn_mask;
   void *buf;
   void *bigbuf; // buf for data.
-  int size;     // buf size, not bigbuf size
-  int rx_depth; // recv wq size
-  int routs;    // outstanding recv wr num
+  size_t bigbuf_size;
+  size_t bigbuf_alloc; // bigbuf_size rounded up to the backend's page
+  enum bw_mem mem;
+  int numa_node; // bigbuf and the rx ring are bound to it, -1: not bound
+  int size;       // buf size, not bigbuf size
+  int rx_depth;   // recv wq size
+  int max_inline; // inline limit granted by the device, over all qps
+  int max_send_wr; // send queue size granted by the device, over all qps
+  int max_send_sge; // sges per send wr granted by the device, over all qps
+  int max_cqe;
+  int atomic_access; // IBV_ACCESS_REMOTE_ATOMIC if the device has atomics
+  // send mode receive ring: rx_depth slots of rx_slot_size bytes per rq,
+  // recvs go to buf when NULL
+  void *rx_ring;
+  size_t rx_alloc;
+  size_t rx_slot_size;
+  struct ibv_mr *rx_mr;
+  int max_rd_atomic;      // reads we may have outstanding as requester
+  int max_dest_rd_atomic; // reads the peer may have outstanding at us
+  int verify; // current step checks or fills messages, see bw_verify_recvs
+  size_t ring_bytes; // --op=ring: ring of each qp, at its buf_addr
+  size_t kv_buckets;  // --op=kv: hash table buckets at the start of bigbuf
+  uint32_t kv_used;   // --op=kv server: value slots taken in this step
+  long kv_full;       // --op=kv server: PUTs that found no room
   struct ibv_port_attr portinfo;
 };
 
@@ -82,6 +263,41 @@ struct bandwidth_dest {
   union ibv_gid gid;
 };
 
+// One binary record per qp, big endian, all records are exchanged in a
+// single message after a qp count. A fixed layout replaces the text records
+// and their sscanf, which dominated the exchange with hundreds of qps.
+struct bw_wire_dest {
+  uint32_t lid;
+  uint32_t qpn;
+  uint32_t psn;
+  uint32_t rkey;
+  uint64_t buf_addr;
+  uint8_t gid[16];
+};
+
+#define BW_WIRE_DEST_SIZE sizeof(struct bw_wire_dest)
+
+// The tcp connection stays open after the exchange. Before every step of
+// the sweep the client sends the size and its iteration count, so --sizes
+// and --duration are only needed on the client.
+struct bw_wire_step {
+  uint64_t size;
+  uint32_t iters;
+  uint32_t flags;
+};
+
+#define BW_STEP_TRIAL 1  // measured step, not a warmup or a probe
+#define BW_STEP_REPORT 2 // last trial of its size
+#define BW_STEP_END 4    // the sweep is over
+#define BW_STEP_VERIFY 8 // --verify: messages carry a crc32c to check
+#define BW_STEP_BASELINE 16 // --verify: unchecked trial to compare against
+
+static inline uint64_t bw_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 enum ibv_mtu bw_mtu_to_enum(int mtu) {
   switch (mtu) {
   case 256:
@@ -113,33 +329,112 @@ int bw_get_port_info(struct ibv_context *context, int port,
   return ibv_query_port(context, port, attr);
 }
 
-void wire_gid_to_gid(const char *wgid, union ibv_gid *gid) {
-  char tmp[9];
-  uint32_t v32;
-  int i;
+static void bw_dest_to_wire(const struct bandwidth_dest *dest,
+                            struct bw_wire_dest *wire) {
+  wire->lid = htonl(dest->lid);
+  wire->qpn = htonl(dest->qpn);
+  wire->psn = htonl(dest->psn);
+  wire->rkey = htonl(dest->rkey);
+  wire->buf_addr = htobe64(dest->buf_addr);
+  memcpy(wire->gid, dest->gid.raw, sizeof wire->gid);
+}
+
+static void bw_wire_to_dest(const struct bw_wire_dest *wire,
+                            struct bandwidth_dest *dest) {
+  dest->lid = ntohl(wire->lid);
+  dest->qpn = ntohl(wire->qpn);
+  dest->psn = ntohl(wire->psn);
+  dest->rkey = ntohl(wire->rkey);
+  dest->buf_addr = be64toh(wire->buf_addr);
+  memcpy(dest->gid.raw, wire->gid, sizeof wire->gid);
+}
 
-  for (tmp[8] = 0, i = 0; i < 4; ++i) {
-    memcpy(tmp, wgid + i * 8, 8);
-    sscanf(tmp, "%x", &v32);
-    *(uint32_t *)(&gid->raw[i * 4]) = ntohl(v32);
+// read()/write() may return short counts once the message outgrows one
+// segment, so loop until all len bytes are moved.
+static ssize_t bw_read_full(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n <= 0)
+      return done ? (ssize_t)done : n;
+    done += n;
   }
+  return done;
 }
 
-void gid_to_wire_gid(const union ibv_gid *gid, char wgid[]) {
-  int i;
+static ssize_t bw_write_full(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if (n <= 0)
+      return done ? (ssize_t)done : n;
+    done += n;
+  }
+  return done;
+}
+
+// pack the qp count and all records into one buffer
+static char *bw_pack_dests(const struct bandwidth_dest *dests, int num,
+                           size_t *len) {
+  char *msg;
+
+  *len = sizeof(uint32_t) + (size_t)num * BW_WIRE_DEST_SIZE;
+  msg = calloc(1, *len);
+  if (!msg)
+    return NULL;
+  *(uint32_t *)msg = htonl(num);
+  for (int i = 0; i < num; i++)
+    bw_dest_to_wire(&dests[i],
+                    (struct bw_wire_dest *)(msg + sizeof(uint32_t)) + i);
+  return msg;
+}
 
-  for (i = 0; i < 4; ++i)
-    sprintf(&wgid[i * 8], "%08x", htonl(*(uint32_t *)(gid->raw + i * 4)));
+// read the qp count and all records sent by bw_pack_dests
+static struct bandwidth_dest *bw_recv_dests(int sockfd, int num) {
+  struct bandwidth_dest *dests;
+  uint32_t rem_num;
+  size_t len = (size_t)num * BW_WIRE_DEST_SIZE;
+  char *msg;
+
+  if (bw_read_full(sockfd, &rem_num, sizeof rem_num) != sizeof rem_num) {
+    perror("read");
+    fprintf(stderr, "Couldn't read remote qp count\n");
+    return NULL;
+  }
+  if ((int)ntohl(rem_num) != num) {
+    fprintf(stderr, "QP count mismatch: local %d, remote %d\n", num,
+            (int)ntohl(rem_num));
+    return NULL;
+  }
+
+  msg = malloc(len);
+  dests = calloc(num, sizeof *dests);
+  if (!msg || !dests)
+    goto err;
+  if (bw_read_full(sockfd, msg, len) != (ssize_t)len) {
+    perror("read");
+    fprintf(stderr, "Couldn't read remote address\n");
+    goto err;
+  }
+  for (int i = 0; i < num; i++)
+    bw_wire_to_dest((struct bw_wire_dest *)msg + i, &dests[i]);
+  free(msg);
+  return dests;
+
+err:
+  free(msg);
+  free(dests);
+  return NULL;
 }
 
-static int bw_connect_ctx(struct bandwidth_context *ctx, int port, int my_psn,
-                          enum ibv_mtu mtu, int sl, struct bandwidth_dest *dest,
-                          int sgid_idx) {
+static int bw_connect_ctx(struct bandwidth_context *ctx, int qp_idx, int port,
+                          int my_psn, enum ibv_mtu mtu, int sl,
+                          struct bandwidth_dest *dest, int sgid_idx) {
   struct ibv_qp_attr attr = {.qp_state = IBV_QPS_RTR,
                              .path_mtu = mtu,
                              .dest_qp_num = dest->qpn,
                              .rq_psn = dest->psn,
-                             .max_dest_rd_atomic = 1,
+                             .max_dest_rd_atomic = ctx->max_dest_rd_atomic,
                              .min_rnr_timer = 12,
                              .ah_attr = {.is_global = 0,
                                          .dlid = dest->lid,
@@ -153,7 +448,7 @@ static int bw_connect_ctx(struct bandwidth_context *ctx, int port, int my_psn,
     attr.ah_attr.grh.dgid = dest->gid;
     attr.ah_attr.grh.sgid_index = sgid_idx;
   }
-  if (ibv_modify_qp(ctx->qp, &attr,
+  if (ibv_modify_qp(ctx->qps[qp_idx].qp, &attr,
                     IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
                         IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
                         IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
@@ -166,8 +461,8 @@ static int bw_connect_ctx(struct bandwidth_context *ctx, int port, int my_psn,
   attr.retry_cnt = 7;
   attr.rnr_retry = 7;
   attr.sq_psn = my_psn;
-  attr.max_rd_atomic = 1;
-  if (ibv_modify_qp(ctx->qp, &attr,
+  attr.max_rd_atomic = ctx->max_rd_atomic;
+  if (ibv_modify_qp(ctx->qps[qp_idx].qp, &attr,
                     IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
                         IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
                         IBV_QP_MAX_QP_RD_ATOMIC)) {
@@ -178,18 +473,94 @@ static int bw_connect_ctx(struct bandwidth_context *ctx, int port, int my_psn,
   return 0;
 }
 
+// qps of one bw_connect_all call, handed out one at a time to its threads
+struct bw_connect_job {
+  struct bandwidth_context *ctx;
+  int port;
+  enum ibv_mtu mtu;
+  int sl;
+  int sgid_idx;
+  const struct bandwidth_dest *my_dest;
+  struct bandwidth_dest *rem_dest;
+  int next;
+  int end;
+  int err;
+};
+
+static void *bw_connect_thread(void *arg) {
+  struct bw_connect_job *job = arg;
+  int i;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->end) {
+    if (bw_connect_ctx(job->ctx, i, job->port, job->my_dest[i].psn, job->mtu,
+                       job->sl, &job->rem_dest[i], job->sgid_idx)) {
+      fprintf(stderr, "Couldn't connect to remote QP %d\n", i);
+      __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Move qps [first, first + num) to RTS. The two ibv_modify_qp calls per qp
+// are kernel round trips, so they run on up to conn_threads threads at once.
+static int bw_connect_all(struct bandwidth_context *ctx, int first, int num,
+                          int port, const struct bandwidth_dest *my_dest,
+                          enum ibv_mtu mtu, int sl,
+                          struct bandwidth_dest *rem_dest, int sgid_idx,
+                          int conn_threads) {
+  struct bw_connect_job job = {.ctx = ctx,
+                               .port = port,
+                               .mtu = mtu,
+                               .sl = sl,
+                               .sgid_idx = sgid_idx,
+                               .my_dest = my_dest,
+                               .rem_dest = rem_dest,
+                               .next = first,
+                               .end = first + num};
+  pthread_t *threads;
+  int started = 0;
+  uint64_t start = bw_now_ns();
+  double usec;
+
+  if (conn_threads > num)
+    conn_threads = num;
+  if (conn_threads < 1)
+    conn_threads = 1;
+  threads = calloc(conn_threads, sizeof *threads);
+  if (!threads)
+    return 1;
+  // the calling thread is connector 0
+  for (int t = 1; t < conn_threads; t++) {
+    if (pthread_create(&threads[t], NULL, bw_connect_thread, &job))
+      break;
+    started++;
+  }
+  bw_connect_thread(&job);
+  for (int t = 1; t <= started; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  usec = (bw_now_ns() - start) / 1000.0;
+  fprintf(bw_info,
+          "connect\t%d\tQPs\t%.1f\tusec\t%.2f\tusec/QP\t%d\tthreads\n", num,
+          usec, num ? usec / num : 0.0, started + 1);
+  return job.err;
+}
+
 static struct bandwidth_dest *
 bw_client_exch_dest(const char *servername, int port,
-                    const struct bandwidth_dest *my_dest) {
+                    const struct bandwidth_dest *my_dest, int num_qps,
+                    int *ctrl_fd) {
   struct addrinfo *res, *t;
   struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
   char *service;
-  char msg[sizeof "0000:000000:000000:00000000:0000000000000000:"
-                  "00000000000000000000000000000000"];
+  char *msg;
+  size_t len;
   int n;
   int sockfd = -1;
   struct bandwidth_dest *rem_dest = NULL;
-  char gid[33];
 
   if (asprintf(&service, "%d", port) < 0)
     return NULL;
@@ -220,49 +591,47 @@ bw_client_exch_dest(const char *servername, int port,
     return NULL;
   }
 
-  gid_to_wire_gid(&my_dest->gid, gid);
-  sprintf(msg, "%04x:%06x:%06x:%08x:%016lx:%s", my_dest->lid, my_dest->qpn,
-          my_dest->psn, my_dest->rkey, (uint64_t)my_dest->buf_addr, gid);
-  if (write(sockfd, msg, sizeof msg) != sizeof msg) {
-    fprintf(stderr, "Couldn't send local address\n");
+  msg = bw_pack_dests(my_dest, num_qps, &len);
+  if (!msg)
     goto out;
-  }
-
-  if (read(sockfd, msg, sizeof msg) != sizeof msg) {
-    perror("client read");
-    fprintf(stderr, "Couldn't read remote address\n");
+  if (bw_write_full(sockfd, msg, len) != (ssize_t)len) {
+    fprintf(stderr, "Couldn't send local address\n");
     goto out;
   }
 
-  write(sockfd, "done", sizeof "done");
-
-  rem_dest = malloc(sizeof *rem_dest);
+  rem_dest = bw_recv_dests(sockfd, num_qps);
   if (!rem_dest)
     goto out;
 
-  sscanf(msg, "%x:%x:%x:%x:%lx:%s", &rem_dest->lid, &rem_dest->qpn,
-         &rem_dest->psn, &rem_dest->rkey, &rem_dest->buf_addr, gid);
-  wire_gid_to_gid(gid, &rem_dest->gid);
+  write(sockfd, "done", sizeof "done");
+  // kept as the control connection of the sweep
+  *ctrl_fd = sockfd;
+  sockfd = -1;
 
 out:
-  close(sockfd);
+  free(msg);
+  if (sockfd >= 0)
+    close(sockfd);
   return rem_dest;
 }
 
 static struct bandwidth_dest *
 bw_server_exch_dest(struct bandwidth_context *ctx, int ib_port,
                     enum ibv_mtu mtu, int port, int sl,
-                    const struct bandwidth_dest *my_dest, int sgid_idx) {
+                    const struct bandwidth_dest *my_dest, int sgid_idx,
+                    int num_clients, int conn_threads, int *ctrl_fds) {
   struct addrinfo *res, *t;
   struct addrinfo hints = {
       .ai_flags = AI_PASSIVE, .ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
   char *service;
-  char msg[sizeof "0000:000000:000000:00000000:0000000000000000:"
-                  "00000000000000000000000000000000"];
+  char *msg = NULL;
+  char done[sizeof "done"];
+  size_t len;
   int n;
-  int sockfd = -1, connfd;
+  int sockfd = -1, connfd = -1;
   struct bandwidth_dest *rem_dest = NULL;
-  char gid[33];
+  // the qps of client c are [c * per_client, (c + 1) * per_client)
+  int per_client = ctx->num_qps / num_clients;
 
   if (asprintf(&service, "%d", port) < 0)
     return NULL;
@@ -297,60 +666,203 @@ bw_server_exch_dest(struct bandwidth_context *ctx, int ib_port,
     return NULL;
   }
 
-  listen(sockfd, 1);
-  connfd = accept(sockfd, NULL, 0);
-  close(sockfd);
-  if (connfd < 0) {
-    fprintf(stderr, "accept() failed\n");
-    return NULL;
-  }
+  listen(sockfd, num_clients);
+  rem_dest = calloc(ctx->num_qps, sizeof *rem_dest);
+  if (!rem_dest)
+    goto err;
 
-  n = read(connfd, msg, sizeof msg);
-  if (n != sizeof msg) {
-    perror("server read");
-    fprintf(stderr, "%d/%d: Couldn't read remote address\n", n,
-            (int)sizeof msg);
-    goto out;
+  for (int c = 0; c < num_clients; c++) {
+    int first = c * per_client;
+    struct bandwidth_dest *client_dest;
+
+    connfd = accept(sockfd, NULL, 0);
+    if (connfd < 0) {
+      fprintf(stderr, "accept() failed\n");
+      goto err;
+    }
+
+    client_dest = bw_recv_dests(connfd, per_client);
+    if (!client_dest)
+      goto err;
+    memcpy(&rem_dest[first], client_dest, per_client * sizeof *rem_dest);
+    free(client_dest);
+
+    if (bw_connect_all(ctx, first, per_client, ib_port, my_dest, mtu, sl,
+                       rem_dest, sgid_idx, conn_threads))
+      goto err;
+
+    msg = bw_pack_dests(&my_dest[first], per_client, &len);
+    if (!msg || bw_write_full(connfd, msg, len) != (ssize_t)len) {
+      fprintf(stderr, "Couldn't send local address\n");
+      goto err;
+    }
+    free(msg);
+    msg = NULL;
+
+    read(connfd, done, sizeof done);
+    ctrl_fds[c] = connfd;
+    connfd = -1;
   }
 
-  rem_dest = malloc(sizeof *rem_dest);
-  if (!rem_dest)
-    goto out;
+  close(sockfd);
+  return rem_dest;
+
+err:
+  free(msg);
+  free(rem_dest);
+  if (connfd >= 0)
+    close(connfd);
+  for (int c = 0; c < num_clients && ctrl_fds[c] >= 0; c++)
+    close(ctrl_fds[c]);
+  close(sockfd);
+  return NULL;
+}
 
-  sscanf(msg, "%x:%x:%x:%x:%lx:%s", &rem_dest->lid, &rem_dest->qpn,
-         &rem_dest->psn, &rem_dest->rkey, &rem_dest->buf_addr, gid);
-  wire_gid_to_gid(gid, &rem_dest->gid);
+#include <sys/param.h>
 
-  if (bw_connect_ctx(ctx, ib_port, my_dest->psn, mtu, sl, rem_dest, sgid_idx)) {
-    fprintf(stderr, "Couldn't connect to remote QP\n");
-    free(rem_dest);
-    rem_dest = NULL;
-    goto out;
+// first qp owned by worker t, worker t owns [bw_qp_begin(t), bw_qp_begin(t+1))
+static int bw_qp_begin(int num_qps, int num_threads, int t) {
+  return (long)num_qps * t / num_threads;
+}
+
+// qp of a completion on a cq shared by several qps
+static struct bandwidth_qp *bw_qp_lookup(struct bandwidth_context *ctx,
+                                         uint32_t qp_num) {
+  int h = qp_num & ctx->qpn_mask;
+
+  while (ctx->qps[ctx->qpn_index[h]].qp->qp_num != qp_num)
+    h = (h + 1) & ctx->qpn_mask;
+  return &ctx->qps[ctx->qpn_index[h]];
+}
+
+static size_t bw_mem_page(enum bw_mem mem) {
+  switch (mem) {
+  case BW_MEM_2M:
+    return 1UL << 21;
+  case BW_MEM_1G:
+    return 1UL << 30;
+  default:
+    return page_size;
   }
+}
 
-  gid_to_wire_gid(&my_dest->gid, gid);
-  sprintf(msg, "%04x:%06x:%06x:%08x:%016lx:%s", my_dest->lid, my_dest->qpn,
-          my_dest->psn, my_dest->rkey, my_dest->buf_addr, gid);
-  if (write(connfd, msg, sizeof msg) != sizeof msg) {
-    fprintf(stderr, "Couldn't send local address\n");
-    free(rem_dest);
-    rem_dest = NULL;
-    goto out;
+// Allocate size bytes from the mem backend, *alloc gets the mapped length.
+// Huge pages come from the preallocated pool and fail rather than fall back
+// to normal pages, so a result is never silently measured on the wrong kind.
+static void *bw_alloc_buf(enum bw_mem mem, size_t size, size_t *alloc) {
+  void *buf;
+
+  *alloc = roundup(size, bw_mem_page(mem));
+  if (mem == BW_MEM_2M || mem == BW_MEM_1G) {
+    int shift = mem == BW_MEM_2M ? 21 : 30;
+    buf = mmap(NULL, *alloc, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                   (shift << MAP_HUGE_SHIFT),
+               -1, 0);
+    return buf == MAP_FAILED ? NULL : buf;
   }
+  if (posix_memalign(&buf, page_size, *alloc)) // essential for good performance
+    return NULL;
+  return buf;
+}
 
-  read(connfd, msg, sizeof msg);
+#define BW_NUMA_AUTO (-2) // --numa default, the device's node
+#define BW_NUMA_MAX 256
 
-out:
-  close(connfd);
-  return rem_dest;
+// numa node of an rdma device as reported by sysfs, -1 if unknown
+static int bw_dev_numa_node(const char *dev_name) {
+  char path[256];
+  int node = -1;
+  FILE *f;
+
+  snprintf(path, sizeof path, "/sys/class/infiniband/%s/device/numa_node",
+           dev_name);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  if (fscanf(f, "%d", &node) != 1)
+    node = -1;
+  fclose(f);
+  return node; // also -1 on machines without numa
 }
 
-#include <sys/param.h>
+// Place [buf, buf + len) on node; pages already touched are moved. Unlike a
+// preferred node, MPOL_BIND doesn't fall back to another node, so a forced
+// cross-socket run really is one.
+static int bw_bind_node(void *buf, size_t len, int node) {
+  unsigned long mask[BW_NUMA_MAX / (8 * sizeof(unsigned long))] = {0};
+
+  if (node < 0)
+    return 0;
+  mask[node / (8 * sizeof *mask)] |= 1UL << (node % (8 * sizeof *mask));
+  return syscall(SYS_mbind, buf, len, MPOL_BIND, mask, BW_NUMA_MAX,
+                 MPOL_MF_MOVE);
+}
+
+// all later allocations of the process, queues and cqs of the driver
+// included, prefer node
+static int bw_prefer_node(int node) {
+  unsigned long mask[BW_NUMA_MAX / (8 * sizeof(unsigned long))] = {0};
+
+  mask[node / (8 * sizeof *mask)] |= 1UL << (node % (8 * sizeof *mask));
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, BW_NUMA_MAX);
+}
+
+static void bw_free_buf(enum bw_mem mem, void *buf, size_t alloc) {
+  if (mem == BW_MEM_2M || mem == BW_MEM_1G)
+    munmap(buf, alloc);
+  else
+    free(buf);
+}
+
+// rc transport ops the device can serve from an odp mr, 0 without odp
+static uint32_t bw_odp_rc_caps(struct ibv_context *context) {
+  struct ibv_device_attr_ex attr;
+
+  if (ibv_query_device_ex(context, NULL, &attr) ||
+      !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT))
+    return 0;
+  return attr.odp_caps.per_transport_caps.rc_odp_caps;
+}
+
+// device clock ticks to ns
+static inline uint64_t bw_hw_ns(uint64_t ticks, uint64_t khz) {
+  return (unsigned __int128)ticks * 1000000 / khz;
+}
+
+// cq for cq_context; the extended engine asks for qp_num and imm to be
+// readable and, if ts_khz is set, for hardware completion timestamps
+static struct ibv_cq *bw_create_cq(struct bandwidth_context *ctx, int cqe,
+                                   struct bandwidth_qp *cq_context,
+                                   enum bw_engine engine, int hw_ts,
+                                   struct ibv_cq_ex **cq_ex) {
+  struct ibv_cq_init_attr_ex attr = {
+      .cqe = cqe,
+      .cq_context = cq_context,
+      .channel = cq_context->channel,
+      .wc_flags = IBV_WC_EX_WITH_QP_NUM | IBV_WC_EX_WITH_IMM |
+                  IBV_WC_EX_WITH_BYTE_LEN |
+                  (hw_ts ? IBV_WC_EX_WITH_COMPLETION_TIMESTAMP : 0)};
+
+  *cq_ex = NULL;
+  if (engine == BW_ENGINE_LEGACY)
+    return ibv_create_cq(ctx->context, cqe, cq_context, cq_context->channel,
+                         0);
+  *cq_ex = ibv_create_cq_ex(ctx->context, &attr);
+  return *cq_ex ? ibv_cq_ex_to_cq(*cq_ex) : NULL;
+}
 
 static struct bandwidth_context *
 bw_init_ctx(struct ibv_device *ib_dev, int size, int rx_depth, int tx_depth,
-            int port, int use_event, int is_server, size_t big_buffer_size) {
+            int port, int use_event, int num_threads, int is_server,
+            size_t big_buffer_size,
+            int num_qps, int inline_size, int rd_atomic, int use_srq,
+            enum bw_mem mem, enum bw_engine engine, int numa_node,
+            int send_sge) {
   struct bandwidth_context *ctx;
+  uint64_t ts_khz = 0;
+  uint64_t start;
+  double alloc_usec;
 
   ctx = calloc(1, sizeof *ctx);
   if (!ctx)
@@ -358,23 +870,39 @@ bw_init_ctx(struct ibv_device *ib_dev, int size, int rx_depth, int tx_depth,
 
   ctx->size = size;
   ctx->rx_depth = rx_depth;
-  ctx->routs = rx_depth;
+  ctx->bigbuf_size = big_buffer_size;
+  ctx->num_qps = num_qps;
+  ctx->max_inline = inline_size;
+  ctx->max_send_wr = INT_MAX;
+  ctx->max_send_sge = send_sge;
+  ctx->qps = calloc(num_qps, sizeof *ctx->qps);
+  if (!ctx->qps)
+    return NULL;
 
   ctx->buf = malloc(roundup(size, page_size));
-  int result =
-      posix_memalign(&ctx->bigbuf, page_size,
-                     big_buffer_size); // essential for good performance
-  if (result != 0) {
-    fprintf(stderr, "Couldn't allocate big buf: %d\n", result);
-    return NULL;
-  }
   if (!ctx->buf) {
     fprintf(stderr, "Couldn't allocate work buf.\n");
     return NULL;
   }
-
   memset(ctx->buf, 0x7b + is_server, size);
+
+  ctx->mem = mem;
+  ctx->numa_node = numa_node;
+  start = bw_now_ns();
+  ctx->bigbuf = bw_alloc_buf(mem, big_buffer_size, &ctx->bigbuf_alloc);
+  if (!ctx->bigbuf) {
+    fprintf(stderr, "Couldn't allocate big buf of %zu bytes on %s pages\n",
+            big_buffer_size, bw_mem_names[mem]);
+    return NULL;
+  }
+  if (bw_bind_node(ctx->bigbuf, ctx->bigbuf_alloc, numa_node)) {
+    fprintf(stderr, "Couldn't bind big buf to numa node %d: %s\n", numa_node,
+            strerror(errno));
+    return NULL;
+  }
+  // also faults every page in, which is part of the start cost
   memset(ctx->bigbuf, 0x3f + is_server, big_buffer_size);
+  alloc_usec = (bw_now_ns() - start) / 1000.0;
 
   ctx->context = ibv_open_device(ib_dev);
   if (!ctx->context) {
@@ -383,14 +911,62 @@ bw_init_ctx(struct ibv_device *ib_dev, int size, int rx_depth, int tx_depth,
     return NULL;
   }
 
+  // a channel per worker, so a sleeping worker is only woken by its own cqs
   if (use_event) {
-    ctx->channel = ibv_create_comp_channel(ctx->context);
-    if (!ctx->channel) {
-      fprintf(stderr, "Couldn't create completion channel\n");
+    ctx->num_channels = num_threads;
+    ctx->channels = calloc(num_threads, sizeof *ctx->channels);
+    if (!ctx->channels)
       return NULL;
+    for (int t = 0; t < num_threads; t++) {
+      ctx->channels[t] = ibv_create_comp_channel(ctx->context);
+      if (!ctx->channels[t]) {
+        fprintf(stderr, "Couldn't create completion channel\n");
+        return NULL;
+      }
+      for (int i = bw_qp_begin(num_qps, num_threads, t);
+           i < bw_qp_begin(num_qps, num_threads, t + 1); i++)
+        ctx->qps[i].channel = ctx->channels[t];
     }
   } else
-    ctx->channel = NULL;
+    ctx->num_channels = 0;
+
+  {
+    struct ibv_device_attr dev_attr;
+
+    if (ibv_query_device(ctx->context, &dev_attr)) {
+      fprintf(stderr, "Couldn't query device\n");
+      return NULL;
+    }
+    // 0 asks for as many outstanding reads as the device allows
+    ctx->max_cqe = dev_attr.max_cqe;
+    ctx->max_rd_atomic = dev_attr.max_qp_init_rd_atom;
+    ctx->max_dest_rd_atomic = dev_attr.max_qp_rd_atom;
+    ctx->atomic_access =
+        dev_attr.atomic_cap != IBV_ATOMIC_NONE ? IBV_ACCESS_REMOTE_ATOMIC : 0;
+    if (send_sge > dev_attr.max_sge) {
+      fprintf(stderr, "gather %d exceeds device limit %d\n", send_sge,
+              dev_attr.max_sge);
+      ctx->max_send_sge = dev_attr.max_sge;
+    }
+    if (rd_atomic > 0) {
+      if (rd_atomic > ctx->max_rd_atomic || rd_atomic > ctx->max_dest_rd_atomic)
+        fprintf(stderr, "rd-atomic %d exceeds device limit %d/%d\n", rd_atomic,
+                ctx->max_rd_atomic, ctx->max_dest_rd_atomic);
+      ctx->max_rd_atomic = MIN(rd_atomic, ctx->max_rd_atomic);
+      ctx->max_dest_rd_atomic = MIN(rd_atomic, ctx->max_dest_rd_atomic);
+    }
+  }
+
+  if (engine == BW_ENGINE_EX) {
+    struct ibv_device_attr_ex attr_ex;
+
+    if (!ibv_query_device_ex(ctx->context, NULL, &attr_ex) &&
+        attr_ex.completion_timestamp_mask && attr_ex.hca_core_clock)
+      ts_khz = attr_ex.hca_core_clock;
+    else
+      fprintf(stderr, "No completion timestamps on %s, host clock used\n",
+              ibv_get_device_name(ib_dev));
+  }
 
   ctx->pd = ibv_alloc_pd(ctx->context);
   if (!ctx->pd) {
@@ -403,51 +979,144 @@ bw_init_ctx(struct ibv_device *ib_dev, int size, int rx_depth, int tx_depth,
     fprintf(stderr, "Couldn't register MR\n");
     return NULL;
   }
+  if (mem == BW_MEM_ODP) {
+    uint32_t need = IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ;
+    if ((bw_odp_rc_caps(ctx->context) & need) != need) {
+      fprintf(stderr, "Device %s has no RC write/read ODP support\n",
+              ibv_get_device_name(ib_dev));
+      return NULL;
+    }
+  }
+  start = bw_now_ns();
   ctx->bigmr = ibv_reg_mr(ctx->pd, ctx->bigbuf, big_buffer_size,
                           IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                              IBV_ACCESS_REMOTE_READ);
+                              IBV_ACCESS_REMOTE_READ | ctx->atomic_access |
+                              (mem == BW_MEM_ODP ? IBV_ACCESS_ON_DEMAND : 0));
   if (!ctx->bigmr) {
     fprintf(stderr, "Couldn't register MR(big)\n");
     return NULL;
   }
+  fprintf(bw_info,
+          "bigbuf\t%s\t%zu\tbytes\t%.1f\talloc-usec\t%.1f\treg-usec\n",
+          bw_mem_names[mem], big_buffer_size, alloc_usec,
+          (bw_now_ns() - start) / 1000.0);
 
-  ctx->cq =
-      ibv_create_cq(ctx->context, rx_depth + tx_depth, NULL, ctx->channel, 0);
-  if (!ctx->cq) {
-    fprintf(stderr, "Couldn't create CQ\n");
-    return NULL;
+  // with an srq the receive buffers no longer scale with the qp count: the
+  // rx_depth receives are shared, and every worker polls a single cq
+  if (use_srq) {
+    struct ibv_srq_init_attr attr = {
+        .attr = {.max_wr = rx_depth, .max_sge = 1}};
+
+    ctx->srq = ibv_create_srq(ctx->pd, &attr);
+    if (!ctx->srq) {
+      fprintf(stderr, "Couldn't create SRQ\n");
+      return NULL;
+    }
+    for (int t = 0; t < num_threads; t++) {
+      int begin = bw_qp_begin(num_qps, num_threads, t);
+      int end = bw_qp_begin(num_qps, num_threads, t + 1);
+      struct ibv_cq *cq;
+      struct ibv_cq_ex *cq_ex;
+
+      if (begin == end)
+        continue;
+      cq = bw_create_cq(
+          ctx, MIN((long)(rx_depth + tx_depth) * (end - begin), ctx->max_cqe),
+          &ctx->qps[begin], engine, ts_khz != 0, &cq_ex);
+      if (!cq) {
+        fprintf(stderr, "Couldn't create CQ for thread %d\n", t);
+        return NULL;
+      }
+      for (int i = begin; i < end; i++) {
+        ctx->qps[i].cq = cq;
+        ctx->qps[i].cq_ex = cq_ex;
+      }
+    }
   }
 
-  {
-    struct ibv_qp_init_attr attr = {
-        .send_cq = ctx->cq,
-        .recv_cq = ctx->cq,
-        .cap = {.max_send_wr = tx_depth,
-                .max_recv_wr = rx_depth,
-                .max_send_sge = 1,
-                .max_recv_sge = 1,
-                .max_inline_data = MAX_INLINE_SIZE}, // add max inline size
-        .qp_type = IBV_QPT_RC};
-
-    ctx->qp = ibv_create_qp(ctx->pd, &attr);
-    if (!ctx->qp) {
-      fprintf(stderr, "Couldn't create QP\n");
+  for (int i = 0; i < num_qps; i++) {
+    struct bandwidth_qp *bq = &ctx->qps[i];
+
+    if (!bq->cq)
+      bq->cq = bw_create_cq(ctx, rx_depth + tx_depth, bq, engine, ts_khz != 0,
+                            &bq->cq_ex);
+    if (!bq->cq) {
+      fprintf(stderr, "Couldn't create CQ %d\n", i);
       return NULL;
     }
+
+    {
+      struct ibv_qp_init_attr_ex attr = {
+          .send_cq = bq->cq,
+          .recv_cq = bq->cq,
+          .srq = ctx->srq,
+          .cap = {.max_send_wr = tx_depth,
+                  .max_recv_wr = ctx->srq ? 0 : rx_depth,
+                  .max_send_sge = ctx->max_send_sge,
+                  .max_recv_sge = 1,
+                  .max_inline_data = inline_size}, // add max inline size
+          .qp_type = IBV_QPT_RC,
+          .comp_mask = IBV_QP_INIT_ATTR_PD,
+          .pd = ctx->pd};
+
+      if (engine == BW_ENGINE_EX) {
+        attr.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+        attr.send_ops_flags =
+            IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+            IBV_QP_EX_WITH_RDMA_READ | IBV_QP_EX_WITH_SEND |
+            (ctx->atomic_access ? IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD |
+                                      IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP
+                                : 0);
+      }
+      bq->qp = ibv_create_qp_ex(ctx->context, &attr);
+      if (!bq->qp) {
+        fprintf(stderr, "Couldn't create QP %d\n", i);
+        return NULL;
+      }
+      if (engine == BW_ENGINE_EX)
+        bq->qpx = ibv_qp_to_qp_ex(bq->qp);
+      if (ts_khz) {
+        bq->ts_khz = ts_khz;
+        bq->ts_context = ctx->context;
+      }
+      // cap now holds what the device actually granted
+      ctx->max_inline = MIN(ctx->max_inline, (int)attr.cap.max_inline_data);
+      ctx->max_send_wr = MIN(ctx->max_send_wr, (int)attr.cap.max_send_wr);
+      ctx->max_send_sge = MIN(ctx->max_send_sge, (int)attr.cap.max_send_sge);
+    }
+
+    {
+      struct ibv_qp_attr attr = {.qp_state = IBV_QPS_INIT,
+                                 .pkey_index = 0,
+                                 .port_num = port,
+                                 .qp_access_flags = IBV_ACCESS_REMOTE_READ |
+                                                    IBV_ACCESS_REMOTE_WRITE |
+                                                    ctx->atomic_access};
+
+      if (ibv_modify_qp(bq->qp, &attr,
+                        IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                            IBV_QP_ACCESS_FLAGS)) {
+        fprintf(stderr, "Failed to modify QP %d to INIT\n", i);
+        return NULL;
+      }
+    }
   }
 
-  {
-    struct ibv_qp_attr attr = {.qp_state = IBV_QPS_INIT,
-                               .pkey_index = 0,
-                               .port_num = port,
-                               .qp_access_flags = IBV_ACCESS_REMOTE_READ |
-                                                  IBV_ACCESS_REMOTE_WRITE};
-
-    if (ibv_modify_qp(ctx->qp, &attr,
-                      IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
-                          IBV_QP_ACCESS_FLAGS)) {
-      fprintf(stderr, "Failed to modify QP to INIT\n");
+  if (ctx->srq) {
+    int n = 1;
+    while (n < 2 * num_qps)
+      n <<= 1;
+    ctx->qpn_mask = n - 1;
+    ctx->qpn_index = malloc(n * sizeof *ctx->qpn_index);
+    if (!ctx->qpn_index)
       return NULL;
+    for (int h = 0; h < n; h++)
+      ctx->qpn_index[h] = -1;
+    for (int i = 0; i < num_qps; i++) {
+      int h = ctx->qps[i].qp->qp_num & ctx->qpn_mask;
+      while (ctx->qpn_index[h] >= 0)
+        h = (h + 1) & ctx->qpn_mask;
+      ctx->qpn_index[h] = i;
     }
   }
 
@@ -455,13 +1124,22 @@ bw_init_ctx(struct ibv_device *ib_dev, int size, int rx_depth, int tx_depth,
 }
 
 int bw_close_ctx(struct bandwidth_context *ctx) {
-  if (ibv_destroy_qp(ctx->qp)) {
-    fprintf(stderr, "Couldn't destroy QP\n");
-    return 1;
+  for (int i = 0; i < ctx->num_qps; i++) {
+    if (ibv_destroy_qp(ctx->qps[i].qp)) {
+      fprintf(stderr, "Couldn't destroy QP %d\n", i);
+      return 1;
+    }
+
+    // a shared cq is destroyed with the last of its qps, once none use it
+    if ((i == ctx->num_qps - 1 || ctx->qps[i + 1].cq != ctx->qps[i].cq) &&
+        ibv_destroy_cq(ctx->qps[i].cq)) {
+      fprintf(stderr, "Couldn't destroy CQ %d\n", i);
+      return 1;
+    }
   }
 
-  if (ibv_destroy_cq(ctx->cq)) {
-    fprintf(stderr, "Couldn't destroy CQ\n");
+  if (ctx->srq && ibv_destroy_srq(ctx->srq)) {
+    fprintf(stderr, "Couldn't destroy SRQ\n");
     return 1;
   }
 
@@ -475,17 +1153,23 @@ int bw_close_ctx(struct bandwidth_context *ctx) {
     return 1;
   }
 
+  if (ctx->rx_mr && ibv_dereg_mr(ctx->rx_mr)) {
+    fprintf(stderr, "Couldn't deregister MR(rx ring)\n");
+    return 1;
+  }
+
   if (ibv_dealloc_pd(ctx->pd)) {
     fprintf(stderr, "Couldn't deallocate PD\n");
     return 1;
   }
 
-  if (ctx->channel) {
-    if (ibv_destroy_comp_channel(ctx->channel)) {
+  for (int t = 0; t < ctx->num_channels; t++) {
+    if (ibv_destroy_comp_channel(ctx->channels[t])) {
       fprintf(stderr, "Couldn't destroy completion channel\n");
       return 1;
     }
   }
+  free(ctx->channels);
 
   if (ibv_close_device(ctx->context)) {
     fprintf(stderr, "Couldn't release context\n");
@@ -493,127 +1177,3477 @@ int bw_close_ctx(struct bandwidth_context *ctx) {
   }
 
   free(ctx->buf);
-  free(ctx->bigbuf);
+  bw_free_buf(ctx->mem, ctx->bigbuf, ctx->bigbuf_alloc);
+  if (ctx->rx_ring)
+    bw_free_buf(ctx->mem, ctx->rx_ring, ctx->rx_alloc);
+  free(ctx->qps);
+  free(ctx->qpn_index);
   free(ctx);
 
   return 0;
 }
 
-static int bw_post_recv(struct bandwidth_context *ctx, int n) {
-  struct ibv_sge list = {
-      .addr = (uintptr_t)ctx->buf, .length = ctx->size, .lkey = ctx->mr->lkey};
-  struct ibv_recv_wr wr = {.wr_id = BANDWIDTH_RECV_WRID,
-                           .sg_list = &list,
-                           .num_sge = 1,
-                           .next = NULL};
-  struct ibv_recv_wr *bad_wr;
-  int i;
-
-  for (i = 0; i < n; ++i)
-    if (ibv_post_recv(ctx->qp, &wr, &bad_wr))
-      break;
+// Time ibv_reg_mr/ibv_dereg_mr of regions from 4KB to max_size, growing 4x,
+// on every backend. The buffers are touched first, so registration is only
+// the pinning and translation work. Unavailable backends are skipped.
+static int bw_reg_bench(struct bandwidth_context *ctx, size_t max_size) {
+  uint32_t odp = bw_odp_rc_caps(ctx->context);
 
-  return i;
-}
+  printf("backend\tbytes\treg-usec\tdereg-usec\n");
+  for (int mem = 0; mem < BW_MEM_NUM; mem++) {
+    if (mem == BW_MEM_ODP && !(odp & IBV_ODP_SUPPORT_WRITE)) {
+      fprintf(stderr, "%s: no ODP support, skipped\n", bw_mem_names[mem]);
+      continue;
+    }
+    for (size_t size = 4096; size <= max_size; size *= 4) {
+      int reps = MAX(3, MIN(100, (long)(max_size / size)));
+      uint64_t reg_ns = 0, dereg_ns = 0;
+      size_t alloc;
+      void *buf = bw_alloc_buf(mem, size, &alloc);
 
-static int bw_post_write(struct bandwidth_context *ctx, uint64_t buf,
-                         uint32_t length, uint64_t remote_addr, uint32_t rkey,
-                         int has_imm, uint32_t imm_data) {
-  struct ibv_sge list = {
-      .addr = buf, .length = length, .lkey = ctx->bigmr->lkey};
-  struct ibv_send_wr *bad_wr, wr = {.wr_id = BANDWIDTH_SEND_WRID,
-                                    .sg_list = &list,
-                                    .num_sge = 1,
-                                    .opcode = IBV_WR_RDMA_WRITE,
-                                    .send_flags = IBV_SEND_SIGNALED,
-                                    .next = NULL,
-                                    .wr.rdma.remote_addr = remote_addr,
-                                    .wr.rdma.rkey = rkey};
-  if (has_imm) {
-    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-    wr.imm_data = imm_data;
+      if (!buf) {
+        fprintf(stderr, "%s: couldn't allocate %zu bytes, skipped\n",
+                bw_mem_names[mem], size);
+        break;
+      }
+      memset(buf, 0, size);
+      for (int r = 0; r < reps; r++) {
+        uint64_t t0 = bw_now_ns(), t1;
+        struct ibv_mr *mr =
+            ibv_reg_mr(ctx->pd, buf, size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           (mem == BW_MEM_ODP ? IBV_ACCESS_ON_DEMAND : 0));
+        if (!mr) {
+          fprintf(stderr, "Couldn't register %zu bytes on %s pages\n", size,
+                  bw_mem_names[mem]);
+          bw_free_buf(mem, buf, alloc);
+          return 1;
+        }
+        t1 = bw_now_ns();
+        ibv_dereg_mr(mr);
+        reg_ns += t1 - t0;
+        dereg_ns += bw_now_ns() - t1;
+      }
+      printf("%s\t%zu\t%.2f\t%.2f\n", bw_mem_names[mem], size,
+             reg_ns / 1000.0 / reps, dereg_ns / 1000.0 / reps);
+      bw_free_buf(mem, buf, alloc);
+    }
   }
-  return ibv_post_send(ctx->qp, &wr, &bad_wr);
+  return 0;
 }
 
-static int bw_post_send(struct bandwidth_context *ctx) {
-  struct ibv_sge list = {
-      .addr = (uint64_t)ctx->buf, .length = ctx->size, .lkey = ctx->mr->lkey};
+// CRC32C (Castagnoli), the checksum of --verify. SSE4.2 has an instruction
+// for it with a latency of 3 cycles and a throughput of 1, so three
+// stripes of a message are summed at once and merged: the crc of a||b is
+// crc(a) shifted over len(b) zero bytes, xor crc(b). The shifts over one
+// and two stripes are linear maps, kept as tables of 4 bytes by 256 values.
+// Without SSE4.2 a byte table does the same at a fraction of the rate.
+#define BW_CRC32C_POLY 0x82f63b78 // reflected
+#define BW_CRC_STRIPE 512
 
-  struct ibv_send_wr *bad_wr, wr = {.wr_id = BANDWIDTH_SEND_WRID,
-                                    .sg_list = &list,
-                                    .num_sge = 1,
-                                    .opcode = IBV_WR_SEND,
-                                    .send_flags = IBV_SEND_SIGNALED,
-                                    .next = NULL};
+static uint32_t bw_crc_table[256];
+static uint32_t bw_crc_shift[2][4][256]; // over 1 and 2 stripes
+static int bw_crc_hw;
 
-  return ibv_post_send(ctx->qp, &wr, &bad_wr);
+static uint32_t bw_crc32c_sw(uint32_t crc, const unsigned char *p,
+                             size_t len) {
+  while (len--)
+    crc = bw_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
 }
 
-int bw_wait_completions(struct bandwidth_context *ctx) {
-  struct ibv_wc wc[WC_BATCH];
-  int n = ibv_poll_cq(ctx->cq, WC_BATCH, wc);
-  int ret = 0; // recv wr cnt
-  for (int i = 0; i < n; i++) {
-    if (wc[i].status != IBV_WC_SUCCESS) {
-      fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-              ibv_wc_status_str(wc[i].status), wc[i].status, (int)wc[i].wr_id);
-      return 0;
-    }
+static void bw_crc32c_init(void) {
+  static const unsigned char zeros[2 * BW_CRC_STRIPE];
 
-    switch ((int)wc[i].wr_id) {
-    case BANDWIDTH_SEND_WRID:
-      break;
+  for (int b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ BW_CRC32C_POLY : crc >> 1;
+    bw_crc_table[b] = crc;
+  }
+  for (int s = 0; s < 2; s++) {
+    uint32_t bit[32];
+    for (int i = 0; i < 32; i++)
+      bit[i] = bw_crc32c_sw(1u << i, zeros, (s + 1) * BW_CRC_STRIPE);
+    for (int k = 0; k < 4; k++)
+      for (int b = 0; b < 256; b++) {
+        uint32_t v = 0;
+        for (int i = 0; i < 8; i++)
+          if (b & (1 << i))
+            v ^= bit[8 * k + i];
+        bw_crc_shift[s][k][b] = v;
+      }
+  }
+#if defined(__x86_64__)
+  bw_crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
 
-    case BANDWIDTH_RECV_WRID:
-      ret++;
-      break;
+static inline uint32_t bw_crc_shifted(int s, uint32_t crc) {
+  return bw_crc_shift[s][0][crc & 0xff] ^
+         bw_crc_shift[s][1][(crc >> 8) & 0xff] ^
+         bw_crc_shift[s][2][(crc >> 16) & 0xff] ^
+         bw_crc_shift[s][3][crc >> 24];
+}
 
-    default:
-      fprintf(stderr, "Completion for unknown wr_id %d\n", (int)wc[i].wr_id);
-      return 0;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+bw_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t a = crc, b, c, x, y, z;
+
+  while (len >= 3 * BW_CRC_STRIPE) {
+    b = c = 0;
+    for (size_t i = 0; i < BW_CRC_STRIPE; i += 8) {
+      memcpy(&x, p + i, 8);
+      memcpy(&y, p + BW_CRC_STRIPE + i, 8);
+      memcpy(&z, p + 2 * BW_CRC_STRIPE + i, 8);
+      a = _mm_crc32_u64(a, x);
+      b = _mm_crc32_u64(b, y);
+      c = _mm_crc32_u64(c, z);
     }
+    a = bw_crc_shifted(1, a) ^ bw_crc_shifted(0, b) ^ c;
+    p += 3 * BW_CRC_STRIPE;
+    len -= 3 * BW_CRC_STRIPE;
   }
-  if (ret > 0 && bw_post_recv(ctx, ret) < ret) {
-    fprintf(stderr, "Failed bw_post_recv\n");
-    return 0;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&x, p, 8);
+    a = _mm_crc32_u64(a, x);
   }
-  return ret;
+  crc = a;
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
 }
+#endif
 
-static void usage(const char *argv0) {
-  printf("Usage:\n");
-  printf("  %s            start a server and wait for connection\n", argv0);
-  printf("  %s <host>     connect to server at <host>\n", argv0);
-  printf("\n");
-  printf("Options:\n");
-  printf("  -p, --port=<port>      listen on/connect to port <port> (default "
-         "18515)\n");
-  printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device "
-         "found)\n");
-  printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
-  printf("  -s, --size=<size>      size of message to exchange (default "
-         "4096)\n");
+static uint32_t bw_crc32c(const void *buf, size_t len) {
+#if defined(__x86_64__)
+  if (bw_crc_hw)
+    return ~bw_crc32c_hw(~0u, buf, len);
+#endif
+  return ~bw_crc32c_sw(~0u, buf, len);
+}
+
+// --verify: every message ends in the crc32c of the bytes before it, little
+// endian. Messages under BW_VERIFY_MIN bytes are not sent in verify steps.
+#define BW_VERIFY_MIN 8
+
+static int bw_verify_msg(const unsigned char *msg, size_t len) {
+  uint32_t crc;
+
+  memcpy(&crc, msg + len - 4, 4);
+  return bw_crc32c(msg, len - 4) == le32toh(crc);
+}
+
+// Check the received messages of one poll before their slots are reposted.
+// The rest of the ring stays posted meanwhile, so the HCA keeps landing
+// later messages while this core checks; a slot goes back to the client as
+// a credit only once its content has been verified.
+static void bw_verify_recvs(struct bandwidth_context *ctx,
+                            struct bandwidth_qp *bq, const uint32_t *slots,
+                            const uint32_t *lens, int n) {
+  uint64_t start = bw_now_ns();
+
+  for (int i = 0; i < n; i++) {
+    if (lens[i] < BW_VERIFY_MIN)
+      continue; // credits, or sizes that carry no crc
+    bq->verified++;
+    bq->verify_bytes += lens[i];
+    // the byte_len of the cqe, -E ex included; a length past the slot
+    // can't be a message of ours and is never read
+    bq->corrupt += lens[i] > ctx->rx_slot_size ||
+                   !bw_verify_msg((unsigned char *)ctx->rx_ring +
+                                      (size_t)slots[i] * ctx->rx_slot_size,
+                                  lens[i]);
+  }
+  bq->verify_ns += bw_now_ns() - start;
+}
+
+// --op=kv: a hash table the client reads without the server's cpu. The
+// server's bigbuf starts with kv_buckets buckets of one cache line with
+// BW_KV_WAYS entries each, the values of the step follow in slots of the
+// value size rounded up to cache lines, taken in insertion order. A key
+// goes to the bucket it hashes to, or the next one while that is full. A
+// GET reads the bucket and then the value; PUTs are sends the server
+// inserts before it credits them. The two never overlap in a step, a mixed
+// load would also need a version in every entry.
+#define BW_KV_WAYS 4
+
+struct bw_kv_entry {
+  uint64_t key; // 0: empty
+  uint32_t slot;
+  uint32_t len;
+};
+
+struct bw_kv_bucket {
+  struct bw_kv_entry e[BW_KV_WAYS];
+};
+
+#define BW_KV_LINE sizeof(struct bw_kv_bucket)
+
+// buckets for keys at a load of at most half the entries
+static size_t bw_kv_buckets(size_t keys) {
+  size_t n = 1;
+  while (n * BW_KV_WAYS < 2 * keys)
+    n <<= 1;
+  return n;
+}
+
+static size_t bw_kv_hash(uint64_t key, size_t buckets) {
+  return (key * 0x9e3779b97f4a7c15ULL >> 32) & (buckets - 1);
+}
+
+static size_t bw_kv_value_off(size_t buckets, uint32_t slot, size_t len) {
+  return buckets * BW_KV_LINE + slot * roundup(len, BW_KV_LINE);
+}
+
+// A PUT is the key, little endian, followed by the value. Workers insert
+// concurrently: an entry is claimed by swapping its key in, and the value
+// slots are taken by an atomic counter.
+static void bw_kv_put(struct bandwidth_context *ctx, const uint32_t *slots,
+                      const uint32_t *lens, int n) {
+  struct bw_kv_bucket *table = ctx->bigbuf;
+
+  for (int i = 0; i < n; i++) {
+    const char *msg =
+        (const char *)ctx->rx_ring + (size_t)slots[i] * ctx->rx_slot_size;
+    size_t len, b;
+    uint64_t key;
+
+    // credits, or nothing past the key; never read beyond the slot
+    if (lens[i] < sizeof(uint64_t) || lens[i] > ctx->rx_slot_size)
+      continue;
+    len = lens[i] - sizeof(uint64_t);
+    memcpy(&key, msg, sizeof key);
+    key = le64toh(key);
+    b = bw_kv_hash(key, ctx->kv_buckets);
+    for (size_t probe = 0; probe < ctx->kv_buckets; probe++) {
+      struct bw_kv_entry *e = NULL;
+
+      for (int j = 0; j < BW_KV_WAYS && !e; j++) {
+        uint64_t empty = 0;
+        struct bw_kv_entry *c = &table[b].e[j];
+        if (__atomic_load_n(&c->key, __ATOMIC_ACQUIRE) == key ||
+            __atomic_compare_exchange_n(&c->key, &empty, key, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+          e = c;
+      }
+      if (e) {
+        uint32_t slot = e->len == len
+                            ? e->slot
+                            : __atomic_fetch_add(&ctx->kv_used, 1,
+                                                 __ATOMIC_RELAXED);
+        size_t off = bw_kv_value_off(ctx->kv_buckets, slot, len);
+        if (off + len > ctx->bigbuf_size) {
+          __atomic_fetch_add(&ctx->kv_full, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        memcpy((char *)ctx->bigbuf + off, msg + sizeof key, len);
+        e->slot = slot;
+        e->len = len;
+        break;
+      }
+      b = (b + 1) & (ctx->kv_buckets - 1);
+    }
+  }
+}
+
+// most recv wrs linked into one ibv_post_recv
+#define BW_RECV_BATCH 16
+
+// Post n recvs as linked lists of up to BW_RECV_BATCH wrs. With a receive
+// ring every recv gets its own slot, slots[i], which comes back in the high
+// wr_id bits; otherwise all of them share buf.
+static int bw_post_recv(struct bandwidth_context *ctx, int qp_idx,
+                        const uint32_t *slots, int n) {
+  struct ibv_sge list[BW_RECV_BATCH];
+  struct ibv_recv_wr wr[BW_RECV_BATCH];
+  struct ibv_recv_wr *bad_wr;
+  int done = 0;
+
+  while (done < n) {
+    int len = MIN(n - done, BW_RECV_BATCH);
+
+    for (int i = 0; i < len; i++) {
+      if (ctx->rx_ring) {
+        list[i].addr = (uintptr_t)ctx->rx_ring +
+                       (size_t)slots[done + i] * ctx->rx_slot_size;
+        list[i].length = ctx->rx_slot_size;
+        list[i].lkey = ctx->rx_mr->lkey;
+        wr[i].wr_id = BW_WRID(BANDWIDTH_RECV_WRID, slots[done + i]);
+      } else {
+        list[i].addr = (uintptr_t)ctx->buf;
+        list[i].length = ctx->size;
+        list[i].lkey = ctx->mr->lkey;
+        wr[i].wr_id = BANDWIDTH_RECV_WRID;
+      }
+      wr[i].sg_list = &list[i];
+      wr[i].num_sge = 1;
+      wr[i].next = i + 1 < len ? &wr[i + 1] : NULL;
+    }
+    if (ctx->srq ? ibv_post_srq_recv(ctx->srq, wr, &bad_wr)
+                 : ibv_post_recv(ctx->qps[qp_idx].qp, wr, &bad_wr))
+      return done + (bad_wr - wr);
+    done += len;
+  }
+  return done;
+}
+
+// Allocate and register the receive ring of send mode, slot_size bytes for
+// each of the rx_depth recvs of every rq.
+static int bw_init_rx_ring(struct bandwidth_context *ctx, size_t slot_size) {
+  int rqs = ctx->srq ? 1 : ctx->num_qps;
+
+  ctx->rx_slot_size = slot_size;
+  ctx->rx_ring = bw_alloc_buf(ctx->mem, (size_t)rqs * ctx->rx_depth * slot_size,
+                              &ctx->rx_alloc);
+  if (!ctx->rx_ring) {
+    fprintf(stderr, "Couldn't allocate the receive ring\n");
+    return 1;
+  }
+  if (bw_bind_node(ctx->rx_ring, ctx->rx_alloc, ctx->numa_node)) {
+    fprintf(stderr, "Couldn't bind the receive ring to numa node %d: %s\n",
+            ctx->numa_node, strerror(errno));
+    return 1;
+  }
+  ctx->rx_mr = ibv_reg_mr(ctx->pd, ctx->rx_ring, ctx->rx_alloc,
+                          IBV_ACCESS_LOCAL_WRITE);
+  if (!ctx->rx_mr) {
+    fprintf(stderr, "Couldn't register the receive ring\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int bw_hist_bucket(uint64_t ns) {
+  int e;
+
+  if (ns < BW_HIST_SUB)
+    return ns;
+  e = 63 - __builtin_clzll(ns);
+  if (e >= BW_HIST_MAX_BITS)
+    return BW_HIST_BUCKETS - 1;
+  return (e - BW_HIST_SUB_BITS + 1) * BW_HIST_SUB +
+         ((ns >> (e - BW_HIST_SUB_BITS)) & (BW_HIST_SUB - 1));
+}
+
+// highest value falling into bucket b
+static uint64_t bw_hist_bucket_max(int b) {
+  int e;
+
+  if (b < BW_HIST_SUB)
+    return b;
+  e = b / BW_HIST_SUB + BW_HIST_SUB_BITS - 1;
+  return ((uint64_t)(BW_HIST_SUB + b % BW_HIST_SUB) << (e - BW_HIST_SUB_BITS)) +
+         (1ULL << (e - BW_HIST_SUB_BITS)) - 1;
+}
+
+static inline void bw_hist_add(struct bw_hist *h, uint64_t ns) {
+  h->buckets[bw_hist_bucket(ns)]++;
+  h->count++;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+static void bw_hist_merge(struct bw_hist *dst, const struct bw_hist *src) {
+  for (int b = 0; b < BW_HIST_BUCKETS; b++)
+    dst->buckets[b] += src->buckets[b];
+  dst->count += src->count;
+  dst->max = MAX(dst->max, src->max);
+}
+
+// value below which the fraction q of the samples lie, in ns
+static uint64_t bw_hist_percentile(const struct bw_hist *h, double q) {
+  uint64_t rank = (uint64_t)(q * h->count), seen = 0;
+
+  for (int b = 0; b < BW_HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank)
+      return MIN(bw_hist_bucket_max(b), h->max);
+  }
+  return h->max;
+}
+
+// Registered-memory slab allocator. Objects of 64B..1MB come from
+// power-of-two size classes, carved in BW_SLAB_CHUNK pieces from a few
+// large regions that are registered once, so an allocation is a free list
+// pop and never an ibv_reg_mr.
+#define BW_SLAB_MIN_SHIFT 6
+#define BW_SLAB_MAX_SHIFT 20
+#define BW_SLAB_CLASSES (BW_SLAB_MAX_SHIFT - BW_SLAB_MIN_SHIFT + 1)
+#define BW_SLAB_CHUNK (2UL << 20)
+#define BW_SLAB_REGION_SIZE (64UL << 20)
+#define BW_SLAB_MAX_REGIONS 16
+
+struct bw_slab_obj {
+  void *addr;
+  uint32_t lkey;
+  uint32_t rkey;
+  int cls;
+  struct bw_slab_obj *next; // free list link
+};
+
+struct bw_slab_region {
+  void *base;
+  size_t alloc;
+  size_t used; // carved so far
+  struct ibv_mr *mr;
+};
+
+struct bw_slab_pool {
+  struct ibv_pd *pd;
+  enum bw_mem mem;
+  int access;
+  struct bw_slab_region regions[BW_SLAB_MAX_REGIONS];
+  int num_regions;
+  struct bw_slab_obj *free[BW_SLAB_CLASSES];
+  struct bw_slab_obj **chunks; // object arrays, one per carved chunk
+  int num_chunks;
+};
+
+static int bw_slab_init(struct bw_slab_pool *pool, struct ibv_pd *pd,
+                        enum bw_mem mem, int access) {
+  memset(pool, 0, sizeof *pool);
+  pool->pd = pd;
+  // odp regions are registered on demand, the pool pins its memory instead
+  pool->mem = mem == BW_MEM_ODP ? BW_MEM_4K : mem;
+  pool->access = access;
+  return 0;
+}
+
+static int bw_slab_class(size_t size) {
+  int cls = 0;
+
+  while (((size_t)1 << (cls + BW_SLAB_MIN_SHIFT)) < size)
+    cls++;
+  return cls;
+}
+
+// split one chunk of the current region into objects of class cls
+static int bw_slab_refill(struct bw_slab_pool *pool, int cls) {
+  size_t obj_size = (size_t)1 << (cls + BW_SLAB_MIN_SHIFT);
+  int n = BW_SLAB_CHUNK / obj_size;
+  struct bw_slab_region *r =
+      pool->num_regions ? &pool->regions[pool->num_regions - 1] : NULL;
+  struct bw_slab_obj *objs, **chunks;
+
+  if (!r || r->used + BW_SLAB_CHUNK > r->alloc) {
+    if (pool->num_regions == BW_SLAB_MAX_REGIONS) {
+      fprintf(stderr, "Slab pool is out of regions\n");
+      return 1;
+    }
+    r = &pool->regions[pool->num_regions];
+    r->base = bw_alloc_buf(pool->mem, BW_SLAB_REGION_SIZE, &r->alloc);
+    if (!r->base) {
+      fprintf(stderr, "Couldn't allocate slab region on %s pages\n",
+              bw_mem_names[pool->mem]);
+      return 1;
+    }
+    r->mr = ibv_reg_mr(pool->pd, r->base, r->alloc, pool->access);
+    if (!r->mr) {
+      fprintf(stderr, "Couldn't register slab region\n");
+      bw_free_buf(pool->mem, r->base, r->alloc);
+      return 1;
+    }
+    r->used = 0;
+    pool->num_regions++;
+  }
+
+  objs = calloc(n, sizeof *objs);
+  chunks = realloc(pool->chunks, (pool->num_chunks + 1) * sizeof *chunks);
+  if (!objs || !chunks) {
+    free(objs);
+    return 1;
+  }
+  pool->chunks = chunks;
+  pool->chunks[pool->num_chunks++] = objs;
+
+  for (int i = 0; i < n; i++) {
+    objs[i].addr = (char *)r->base + r->used + i * obj_size;
+    objs[i].lkey = r->mr->lkey;
+    objs[i].rkey = r->mr->rkey;
+    objs[i].cls = cls;
+    objs[i].next = i + 1 < n ? &objs[i + 1] : pool->free[cls];
+  }
+  pool->free[cls] = objs;
+  r->used += BW_SLAB_CHUNK;
+  return 0;
+}
+
+// registered buffer of at least size bytes, NULL above 1MB or when the
+// pool is exhausted
+static struct bw_slab_obj *bw_slab_alloc(struct bw_slab_pool *pool,
+                                         size_t size) {
+  struct bw_slab_obj *obj;
+  int cls;
+
+  if (size > ((size_t)1 << BW_SLAB_MAX_SHIFT))
+    return NULL;
+  cls = bw_slab_class(size);
+  if (!pool->free[cls] && bw_slab_refill(pool, cls))
+    return NULL;
+  obj = pool->free[cls];
+  pool->free[cls] = obj->next;
+  return obj;
+}
+
+static void bw_slab_free(struct bw_slab_pool *pool, struct bw_slab_obj *obj) {
+  obj->next = pool->free[obj->cls];
+  pool->free[obj->cls] = obj;
+}
+
+static void bw_slab_destroy(struct bw_slab_pool *pool) {
+  for (int i = 0; i < pool->num_regions; i++) {
+    ibv_dereg_mr(pool->regions[i].mr);
+    bw_free_buf(pool->mem, pool->regions[i].base, pool->regions[i].alloc);
+  }
+  for (int i = 0; i < pool->num_chunks; i++)
+    free(pool->chunks[i]);
+  free(pool->chunks);
+}
+
+// Cache of registrations of user memory, keyed by start address. A lookup
+// hits when an earlier registration of the same address covers the length
+// and access. Each key probes BW_MR_CACHE_WAYS slots and a miss evicts the
+// least recently used of them. Memory returned to the system must be
+// dropped with bw_mr_cache_invalidate, or a later buffer at the same
+// address would reuse a stale translation.
+#define BW_MR_CACHE_WAYS 8
+
+struct bw_mr_cache_entry {
+  uintptr_t addr;
+  size_t len;
+  int access;
+  struct ibv_mr *mr;
+  uint64_t last_use;
+};
+
+struct bw_mr_cache {
+  struct ibv_pd *pd;
+  struct bw_mr_cache_entry *slots;
+  int mask;
+  uint64_t clock;
+  long hits;
+  long misses;
+  long evictions;
+};
+
+static int bw_mr_cache_init(struct bw_mr_cache *cache, struct ibv_pd *pd,
+                            int entries) {
+  int n = BW_MR_CACHE_WAYS;
+
+  while (n < entries)
+    n <<= 1;
+  memset(cache, 0, sizeof *cache);
+  cache->pd = pd;
+  cache->mask = n - 1;
+  cache->slots = calloc(n, sizeof *cache->slots);
+  return cache->slots ? 0 : 1;
+}
+
+static inline int bw_mr_cache_slot(struct bw_mr_cache *cache, uintptr_t addr,
+                                   int way) {
+  // buffers are at least cache line aligned, mix in the higher bits
+  return (((addr >> 6) * 0x9e3779b97f4a7c15ULL >> 32) + way) & cache->mask;
+}
+
+static struct ibv_mr *bw_mr_cache_get(struct bw_mr_cache *cache, void *buf,
+                                      size_t len, int access) {
+  uintptr_t addr = (uintptr_t)buf;
+  struct bw_mr_cache_entry *victim = NULL;
+
+  cache->clock++;
+  for (int way = 0; way < BW_MR_CACHE_WAYS; way++) {
+    struct bw_mr_cache_entry *e =
+        &cache->slots[bw_mr_cache_slot(cache, addr, way)];
+
+    if (e->mr && e->addr == addr) {
+      if (len <= e->len && (access & ~e->access) == 0) {
+        e->last_use = cache->clock;
+        cache->hits++;
+        return e->mr;
+      }
+      // too small or too few rights, register again in its place
+      victim = e;
+      break;
+    }
+    if (!victim || !e->mr || (victim->mr && e->last_use < victim->last_use))
+      victim = e;
+  }
+
+  cache->misses++;
+  if (victim->mr) {
+    ibv_dereg_mr(victim->mr);
+    cache->evictions++;
+  }
+  victim->mr = ibv_reg_mr(cache->pd, buf, len, access);
+  if (!victim->mr)
+    return NULL;
+  victim->addr = addr;
+  victim->len = len;
+  victim->access = access;
+  victim->last_use = cache->clock;
+  return victim->mr;
+}
+
+static void bw_mr_cache_invalidate(struct bw_mr_cache *cache, void *buf) {
+  for (int way = 0; way < BW_MR_CACHE_WAYS; way++) {
+    struct bw_mr_cache_entry *e =
+        &cache->slots[bw_mr_cache_slot(cache, (uintptr_t)buf, way)];
+
+    if (e->mr && e->addr == (uintptr_t)buf) {
+      ibv_dereg_mr(e->mr);
+      e->mr = NULL;
+    }
+  }
+}
+
+static void bw_mr_cache_destroy(struct bw_mr_cache *cache) {
+  for (int i = 0; cache->slots && i <= cache->mask; i++)
+    if (cache->slots[i].mr)
+      ibv_dereg_mr(cache->slots[i].mr);
+  free(cache->slots);
+}
+
+#define BW_SLAB_BENCH_LIVE 64   // allocations held at once
+#define BW_SLAB_BENCH_USER 256  // user buffers the mr cache sees
+#define BW_SLAB_BENCH_MAX (64 << 10)
+#define BW_SLAB_BENCH_RECYCLE 64 // 1 in this many user buffers is replaced
+
+enum bw_slab_bench_mode {
+  BW_SLAB_BENCH_REG,   // malloc + ibv_reg_mr per request
+  BW_SLAB_BENCH_CACHE, // user buffers, registered through the mr cache
+  BW_SLAB_BENCH_SLAB,  // bw_slab_alloc from pre-registered regions
+};
+
+static const char *bw_slab_bench_names[] = {"reg", "cache", "slab"};
+
+// 64B..128KB, about as many requests of every power of two from 64B to 64KB
+// and up to twice that
+static size_t bw_slab_bench_size(unsigned int *seed) {
+  int shift = BW_SLAB_MIN_SHIFT + rand_r(seed) % 11;
+  return ((size_t)1 << shift) + rand_r(seed) % ((size_t)1 << shift);
+}
+
+// release what a mode of bw_slab_bench holds, a second call does nothing
+static void bw_slab_bench_release(struct ibv_mr **mrs, void **bufs,
+                                  struct bw_mr_cache *cache,
+                                  struct bw_slab_pool *pool) {
+  for (int i = 0; i < BW_SLAB_BENCH_LIVE; i++) {
+    if (mrs[i])
+      ibv_dereg_mr(mrs[i]);
+    free(bufs[i]);
+    mrs[i] = NULL;
+    bufs[i] = NULL;
+  }
+  bw_mr_cache_destroy(cache);
+  bw_slab_destroy(pool);
+  memset(cache, 0, sizeof *cache);
+  memset(pool, 0, sizeof *pool);
+}
+
+// Time ops acquire/release pairs of a registered buffer in each mode, with
+// BW_SLAB_BENCH_LIVE buffers alive at once. The p99 and max show the
+// registration spikes the mean hides.
+static int bw_slab_bench(struct bandwidth_context *ctx, long ops) {
+  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+               IBV_ACCESS_REMOTE_READ;
+  static struct bw_hist hist;
+  struct ibv_mr *mrs[BW_SLAB_BENCH_LIVE] = {0};
+  void *bufs[BW_SLAB_BENCH_LIVE] = {0};
+  struct bw_slab_pool pool = {0};
+  struct bw_mr_cache cache = {0};
+  void *user[BW_SLAB_BENCH_USER] = {0};
+  int ret = 1;
+
+  for (int i = 0; i < BW_SLAB_BENCH_USER; i++)
+    if (posix_memalign(&user[i], page_size, 2 * BW_SLAB_BENCH_MAX)) {
+      user[i] = NULL;
+      goto out;
+    }
+
+  printf("mode\tops\tns/op\tp50-usec\tp99-usec\tmax-usec\n");
+  for (int mode = 0; mode <= BW_SLAB_BENCH_SLAB; mode++) {
+    struct bw_slab_obj *objs[BW_SLAB_BENCH_LIVE] = {0};
+    unsigned int seed = 1;
+    uint64_t start;
+
+    memset(&hist, 0, sizeof hist);
+    if (bw_slab_init(&pool, ctx->pd, ctx->mem, access) ||
+        bw_mr_cache_init(&cache, ctx->pd, 4 * BW_SLAB_BENCH_USER))
+      goto out;
+
+    start = bw_now_ns();
+    for (long op = 0; op < ops; op++) {
+      int slot = op % BW_SLAB_BENCH_LIVE;
+      size_t size = bw_slab_bench_size(&seed);
+      uint64_t t0 = bw_now_ns();
+      void *addr;
+      uint32_t lkey;
+
+      switch (mode) {
+      case BW_SLAB_BENCH_REG:
+        if (mrs[slot]) {
+          ibv_dereg_mr(mrs[slot]);
+          free(bufs[slot]);
+        }
+        bufs[slot] = malloc(size);
+        mrs[slot] = bufs[slot] ? ibv_reg_mr(ctx->pd, bufs[slot], size, access)
+                               : NULL;
+        if (!mrs[slot]) {
+          fprintf(stderr, "Couldn't register %zu bytes\n", size);
+          goto out;
+        }
+        addr = bufs[slot];
+        lkey = mrs[slot]->lkey;
+        break;
+
+      case BW_SLAB_BENCH_CACHE: {
+        // the same user buffer is requested with varying lengths, and now
+        // and then the application frees it and allocates another one
+        struct ibv_mr *mr;
+        int u = rand_r(&seed) % BW_SLAB_BENCH_USER;
+        if (rand_r(&seed) % BW_SLAB_BENCH_RECYCLE == 0) {
+          bw_mr_cache_invalidate(&cache, user[u]);
+          free(user[u]);
+          if (posix_memalign(&user[u], page_size, 2 * BW_SLAB_BENCH_MAX)) {
+            user[u] = NULL;
+            goto out;
+          }
+        }
+        addr = user[u];
+        mr = bw_mr_cache_get(&cache, addr, size, access);
+        if (!mr) {
+          fprintf(stderr, "Couldn't register %zu bytes\n", size);
+          goto out;
+        }
+        lkey = mr->lkey;
+        break;
+      }
+
+      default:
+        if (objs[slot])
+          bw_slab_free(&pool, objs[slot]);
+        objs[slot] = bw_slab_alloc(&pool, size);
+        if (!objs[slot])
+          goto out;
+        addr = objs[slot]->addr;
+        lkey = objs[slot]->lkey;
+        break;
+      }
+      *(volatile uint32_t *)addr = lkey;
+      bw_hist_add(&hist, bw_now_ns() - t0);
+    }
+
+    printf("%s\t%ld\t%.1f\t%.2f\t%.2f\t%.2f", bw_slab_bench_names[mode], ops,
+           (double)(bw_now_ns() - start) / ops,
+           bw_hist_percentile(&hist, 0.5) / 1000.0,
+           bw_hist_percentile(&hist, 0.99) / 1000.0, hist.max / 1000.0);
+    if (mode == BW_SLAB_BENCH_CACHE)
+      printf("\t%.4f\thit-rate\t%ld\tevictions",
+             (double)cache.hits / (cache.hits + cache.misses),
+             cache.evictions);
+    printf("\n");
+    bw_slab_bench_release(mrs, bufs, &cache, &pool);
+  }
+  ret = 0;
+
+out:
+  bw_slab_bench_release(mrs, bufs, &cache, &pool);
+  for (int i = 0; i < BW_SLAB_BENCH_USER; i++)
+    free(user[i]);
+  return ret;
+}
+
+// Post time in the clock completions are stamped with. With hardware
+// timestamps that is the device clock, read through the mapped hca clock
+// so no system call is made.
+static inline uint64_t bw_post_clock(struct bandwidth_qp *bq) {
+  if (bq->ts_context) {
+    struct ibv_values_ex values = {.comp_mask = IBV_VALUES_MASK_RAW_CLOCK};
+    if (!ibv_query_rt_values_ex(bq->ts_context, &values))
+      return bw_hw_ns(values.raw_clock.tv_nsec, bq->ts_khz);
+  }
+  return bw_now_ns();
+}
+
+// account n wrs just handed to the send queue; ctrl wrs (credits, heads)
+// are tagged so they never enter the latency histogram
+static inline void bw_sq_post(struct bandwidth_qp *bq, int n, int ctrl) {
+  if (bq->hist) {
+    uint64_t now = ctrl ? 0 : bw_post_clock(bq);
+    for (int i = 0; i < n; i++)
+      bq->post_ns[(bq->sq_posted + i) % bq->hist_ring] = now;
+  }
+  bq->sq_posted += n;
+  bq->sq_outstanding += n;
+}
+
+// Retire the n oldest send wrs, completed at now. A cqe of a signaled ctrl
+// wr may retire unsignaled data wrs posted before it, and a data cqe the
+// ctrl wr, so the slot tags decide what is sampled, not the cqe.
+static inline void bw_sq_retire(struct bandwidth_qp *bq, int n, uint64_t now) {
+  if (bq->hist) {
+    long oldest = bq->sq_posted - bq->sq_outstanding;
+    for (int i = 0; i < n; i++) {
+      uint64_t posted = bq->post_ns[(oldest + i) % bq->hist_ring];
+      if (posted)
+        bw_hist_add(bq->hist, now - posted);
+    }
+  }
+  bq->sq_outstanding -= n;
+}
+
+static int bw_chain_init(struct bw_chain *c, struct bandwidth_context *ctx,
+                         int batch, int signal_every) {
+  c->wr = calloc(batch, sizeof *c->wr);
+  c->max_sge = MAX(ctx->max_send_sge, 1);
+  c->sge = calloc((size_t)batch * c->max_sge, sizeof *c->sge);
+  c->batch = batch;
+  c->signal_every = signal_every;
+  c->len = 0;
+  c->send_flags = 0;
+  if (!c->wr || !c->sge)
+    return 1;
+  for (int i = 0; i < batch * c->max_sge; i++)
+    c->sge[i].lkey = ctx->bigmr->lkey;
+  for (int i = 0; i < batch; i++) {
+    c->wr[i].sg_list = &c->sge[i * c->max_sge];
+    c->wr[i].num_sge = 1;
+    c->wr[i].opcode = IBV_WR_RDMA_WRITE;
+    c->wr[i].next = i + 1 < batch ? &c->wr[i + 1] : NULL;
+  }
+  return 0;
+}
+
+// set the message length of the following writes; small ones are copied
+// into the wqe by the cpu instead of being fetched by the HCA
+static void bw_chain_set_length(struct bw_chain *c,
+                                struct bandwidth_context *ctx,
+                                uint32_t length) {
+  for (int i = 0; i < c->batch; i++) {
+    c->wr[i].sg_list->length = length;
+    c->wr[i].num_sge = 1;
+  }
+  c->send_flags = (int)length <= ctx->max_inline ? IBV_SEND_INLINE : 0;
+}
+
+static void bw_chain_free(struct bw_chain *c) {
+  free(c->wr);
+  free(c->sge);
+}
+
+// The extended engine takes the same wr list: every wr becomes ibv_wr_*
+// calls between ibv_wr_start and ibv_wr_complete, still one doorbell.
+static int bw_post_ex(struct ibv_qp_ex *qpx, struct ibv_send_wr *wr) {
+  ibv_wr_start(qpx);
+  for (; wr; wr = wr->next) {
+    qpx->wr_id = wr->wr_id;
+    qpx->wr_flags = wr->send_flags & ~IBV_SEND_INLINE;
+    switch (wr->opcode) {
+    case IBV_WR_RDMA_WRITE:
+      ibv_wr_rdma_write(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+      break;
+    case IBV_WR_RDMA_WRITE_WITH_IMM:
+      ibv_wr_rdma_write_imm(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr,
+                            wr->imm_data);
+      break;
+    case IBV_WR_RDMA_READ:
+      ibv_wr_rdma_read(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+      break;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+      ibv_wr_atomic_fetch_add(qpx, wr->wr.atomic.rkey,
+                              wr->wr.atomic.remote_addr,
+                              wr->wr.atomic.compare_add);
+      break;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+      ibv_wr_atomic_cmp_swp(qpx, wr->wr.atomic.rkey, wr->wr.atomic.remote_addr,
+                            wr->wr.atomic.compare_add, wr->wr.atomic.swap);
+      break;
+    default:
+      ibv_wr_send(qpx);
+      break;
+    }
+    if (wr->send_flags & IBV_SEND_INLINE && wr->num_sge > 1) {
+      struct ibv_data_buf bufs[wr->num_sge];
+      for (int i = 0; i < wr->num_sge; i++) {
+        bufs[i].addr = (void *)wr->sg_list[i].addr;
+        bufs[i].length = wr->sg_list[i].length;
+      }
+      ibv_wr_set_inline_data_list(qpx, wr->num_sge, bufs);
+    } else if (wr->send_flags & IBV_SEND_INLINE)
+      ibv_wr_set_inline_data(qpx, (void *)wr->sg_list->addr,
+                             wr->sg_list->length);
+    else
+      ibv_wr_set_sge_list(qpx, wr->num_sge, wr->sg_list);
+  }
+  return ibv_wr_complete(qpx);
+}
+
+static inline int bw_post_wrs(struct bandwidth_qp *bq,
+                              struct ibv_send_wr *wr) {
+  struct ibv_send_wr *bad_wr;
+
+  if (bq->qpx)
+    return bw_post_ex(bq->qpx, wr);
+  return ibv_post_send(bq->qp, wr, &bad_wr);
+}
+
+// post the linked wrs with one doorbell
+static int bw_flush_writes(struct bandwidth_context *ctx, int qp_idx,
+                           struct bw_chain *c) {
+  int ret;
+
+  if (c->len == 0)
+    return 0;
+  c->wr[c->len - 1].next = NULL;
+  ret = bw_post_wrs(&ctx->qps[qp_idx], c->wr);
+  if (ret == 0)
+    bw_sq_post(&ctx->qps[qp_idx], c->len, 0);
+  if (c->len < c->batch) // restore the template link
+    c->wr[c->len - 1].next = &c->wr[c->len];
+  c->len = 0;
+  return ret;
+}
+
+// Link one write into the chain, posting it once batch wrs are collected.
+// Only every signal_every-th wr and the write_with_imm closing a burst are
+// signaled; the send queue is drained through those completions.
+static int bw_post_write(struct bandwidth_context *ctx, int qp_idx,
+                         struct bw_chain *c, uint64_t buf,
+                         uint64_t remote_addr, uint32_t rkey, int has_imm,
+                         uint32_t imm_data) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  struct ibv_send_wr *wr = &c->wr[c->len];
+
+  wr->sg_list->addr = buf;
+  wr->wr.rdma.remote_addr = remote_addr;
+  wr->wr.rdma.rkey = rkey;
+  wr->send_flags = c->send_flags;
+  wr->wr_id = 0;
+  if (has_imm) {
+    wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr->imm_data = imm_data;
+  } else {
+    wr->opcode = IBV_WR_RDMA_WRITE;
+  }
+  if (++bq->unsignaled == c->signal_every || has_imm) {
+    wr->send_flags |= IBV_SEND_SIGNALED;
+    wr->wr_id = BW_SEND_WRID(bq->unsignaled);
+    bq->unsignaled = 0;
+  }
+
+  if (++c->len == c->batch)
+    return bw_flush_writes(ctx, qp_idx, c);
+  return 0;
+}
+
+// bw_post_write of a message the HCA gathers from n fragments
+static int bw_post_gather(struct bandwidth_context *ctx, int qp_idx,
+                          struct bw_chain *c, const struct ibv_sge *sge,
+                          int n, uint64_t remote_addr, uint32_t rkey,
+                          int has_imm, uint32_t imm_data) {
+  struct ibv_send_wr *wr = &c->wr[c->len];
+
+  memcpy(wr->sg_list, sge, n * sizeof *sge);
+  wr->num_sge = n;
+  return bw_post_write(ctx, qp_idx, c, sge[0].addr, remote_addr, rkey,
+                       has_imm, imm_data);
+}
+
+// Same as bw_post_write for a read of the peer's bigbuf into buf. Reads are
+// never inline; force_signal marks the last read the caller waits for.
+static int bw_post_read(struct bandwidth_context *ctx, int qp_idx,
+                        struct bw_chain *c, uint64_t buf, uint64_t remote_addr,
+                        uint32_t rkey, int force_signal) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  struct ibv_send_wr *wr = &c->wr[c->len];
+
+  wr->sg_list->addr = buf;
+  wr->wr.rdma.remote_addr = remote_addr;
+  wr->wr.rdma.rkey = rkey;
+  wr->opcode = IBV_WR_RDMA_READ;
+  wr->send_flags = 0;
+  wr->wr_id = 0;
+  if (++bq->unsignaled == c->signal_every || force_signal) {
+    wr->send_flags = IBV_SEND_SIGNALED;
+    wr->wr_id = BW_WRID(BANDWIDTH_READ_WRID, bq->unsignaled);
+    bq->unsignaled = 0;
+  }
+
+  if (++c->len == c->batch)
+    return bw_flush_writes(ctx, qp_idx, c);
+  return 0;
+}
+
+// Same as bw_post_read for an 8-byte atomic on the peer's word at
+// remote_addr, the old value lands in buf. A cas expects seq and stores
+// seq + 1, so it only succeeds while no one else moved the word since the
+// poster's own last cas on it.
+static int bw_post_atomic(struct bandwidth_context *ctx, int qp_idx,
+                          struct bw_chain *c, enum bw_op op, uint64_t buf,
+                          uint64_t remote_addr, uint32_t rkey, uint64_t seq,
+                          int force_signal) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  struct ibv_send_wr *wr = &c->wr[c->len];
+
+  wr->sg_list->addr = buf;
+  wr->wr.atomic.remote_addr = remote_addr;
+  wr->wr.atomic.rkey = rkey;
+  if (op == BW_OP_FADD) {
+    wr->opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+    wr->wr.atomic.compare_add = 1;
+  } else {
+    wr->opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+    wr->wr.atomic.compare_add = seq;
+    wr->wr.atomic.swap = seq + 1;
+  }
+  wr->send_flags = 0;
+  wr->wr_id = 0;
+  if (++bq->unsignaled == c->signal_every || force_signal) {
+    wr->send_flags = IBV_SEND_SIGNALED;
+    wr->wr_id = BW_WRID(BANDWIDTH_READ_WRID, bq->unsignaled);
+    bq->unsignaled = 0;
+  }
+
+  if (++c->len == c->batch)
+    return bw_flush_writes(ctx, qp_idx, c);
+  return 0;
+}
+
+// Same as bw_post_write for a send into the next recv of the peer; small
+// sends are inline as well.
+static int bw_post_msg(struct bandwidth_context *ctx, int qp_idx,
+                       struct bw_chain *c, uint64_t buf, int force_signal) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  struct ibv_send_wr *wr = &c->wr[c->len];
+
+  wr->sg_list->addr = buf;
+  wr->opcode = IBV_WR_SEND;
+  wr->send_flags = c->send_flags;
+  wr->wr_id = 0;
+  if (++bq->unsignaled == c->signal_every || force_signal) {
+    wr->send_flags |= IBV_SEND_SIGNALED;
+    wr->wr_id = BW_SEND_WRID(bq->unsignaled);
+    bq->unsignaled = 0;
+  }
+
+  if (++c->len == c->batch)
+    return bw_flush_writes(ctx, qp_idx, c);
+  return 0;
+}
+
+static int bw_post_send(struct bandwidth_context *ctx, int qp_idx) {
+  struct ibv_sge list = {
+      .addr = (uint64_t)ctx->buf, .length = ctx->size, .lkey = ctx->mr->lkey};
+
+  struct ibv_send_wr wr = {.wr_id = BW_CTRL_WRID,
+                           .sg_list = &list,
+                           .num_sge = 1,
+                           .opcode = IBV_WR_SEND,
+                           .send_flags = IBV_SEND_SIGNALED,
+                           .next = NULL};
+  int ret = bw_post_wrs(&ctx->qps[qp_idx], &wr);
+
+  if (ret == 0)
+    bw_sq_post(&ctx->qps[qp_idx], 1, 1);
+  return ret;
+}
+
+// zero-length write_with_imm returning credits to the peer
+static int bw_post_credit(struct bandwidth_context *ctx, int qp_idx,
+                          uint64_t remote_addr, uint32_t rkey,
+                          uint32_t credits) {
+  struct ibv_send_wr wr = {.wr_id = BW_CTRL_WRID,
+                           .sg_list = NULL,
+                           .num_sge = 0,
+                           .opcode = IBV_WR_RDMA_WRITE_WITH_IMM,
+                           .send_flags = IBV_SEND_SIGNALED,
+                           .imm_data = htonl(credits),
+                           .next = NULL,
+                           .wr.rdma.remote_addr = remote_addr,
+                           .wr.rdma.rkey = rkey};
+  int ret = bw_post_wrs(&ctx->qps[qp_idx], &wr);
+
+  if (ret == 0)
+    bw_sq_post(&ctx->qps[qp_idx], 1, 1);
+  return ret;
+}
+
+// --op=ring: a one-sided message channel in the peer's bigbuf. Every qp has
+// a ring of ring_bytes at its buf_addr on both sides; the last cache line
+// of the ring is not used for records but receives the server's head. A
+// record is a mark, the payload and the same mark again, padded to whole
+// cache lines. The HCA writes a record in address order, so once the
+// trailing mark carries the expected sequence number the whole record has
+// landed and the server needs no cqe to find it. Sequence numbers keep
+// counting over the run, so records of an earlier lap never match.
+struct bw_ring_mark {
+  uint32_t len; // payload bytes, little endian
+  uint32_t seq;
+};
+
+#define BW_RING_LINE 64
+#define BW_RING_PINGS 1000 // records per qp timed one at a time
+
+static size_t bw_ring_record(size_t size) {
+  return roundup(size + 2 * sizeof(struct bw_ring_mark), BW_RING_LINE);
+}
+
+static uint32_t bw_ring_slots(struct bandwidth_context *ctx, size_t rec) {
+  return (ctx->ring_bytes - BW_RING_LINE) / rec;
+}
+
+// records of a step after its streamed ones, a round trip each
+static int bw_ring_pings(int iters) { return MIN(iters, BW_RING_PINGS); }
+
+static volatile uint64_t *bw_ring_head(struct bandwidth_context *ctx,
+                                       const struct bandwidth_dest *my) {
+  return (volatile uint64_t *)(uintptr_t)(my->buf_addr + ctx->ring_bytes -
+                                          BW_RING_LINE);
+}
+
+// server: tell the client the last record consumed on qp_idx, an 8 byte
+// write into the head line of its ring
+static int bw_post_head(struct bandwidth_context *ctx, int qp_idx,
+                        const struct bandwidth_dest *my,
+                        const struct bandwidth_dest *rem) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  volatile uint64_t *line = bw_ring_head(ctx, my);
+  struct ibv_sge list = {.addr = (uintptr_t)line,
+                         .length = sizeof *line,
+                         .lkey = ctx->bigmr->lkey};
+  struct ibv_send_wr wr = {
+      .wr_id = BW_CTRL_WRID,
+      .sg_list = &list,
+      .num_sge = 1,
+      .opcode = IBV_WR_RDMA_WRITE,
+      .send_flags = IBV_SEND_SIGNALED |
+                    (ctx->max_inline >= (int)sizeof *line ? IBV_SEND_INLINE
+                                                          : 0),
+      .next = NULL,
+      .wr.rdma.remote_addr = rem->buf_addr + ctx->ring_bytes - BW_RING_LINE,
+      .wr.rdma.rkey = rem->rkey};
+  int ret;
+
+  *line = htole64(bq->ring_seq);
+  ret = bw_post_wrs(bq, &wr);
+  if (ret == 0) {
+    bw_sq_post(bq, 1, 1);
+    bq->ring_acked = bq->ring_seq;
+  }
+  return ret;
+}
+
+// Extended engine poll, into the same ibv_wc fields the legacy path fills.
+// ts gets each completion's hardware timestamp in ns when the cq has them.
+static int bw_poll_ex(struct bandwidth_qp *bq, struct ibv_wc *wc,
+                      uint64_t *ts) {
+  struct ibv_cq_ex *cq = bq->cq_ex;
+  struct ibv_poll_cq_attr attr = {};
+  int n = 0;
+  int ret = ibv_start_poll(cq, &attr);
+
+  if (ret)
+    return ret == ENOENT ? 0 : -1;
+  do {
+    wc[n].wr_id = cq->wr_id;
+    wc[n].status = cq->status;
+    wc[n].opcode = ibv_wc_read_opcode(cq);
+    wc[n].byte_len = ibv_wc_read_byte_len(cq);
+    wc[n].qp_num = ibv_wc_read_qp_num(cq);
+    wc[n].wc_flags = ibv_wc_read_wc_flags(cq);
+    if (wc[n].wc_flags & IBV_WC_WITH_IMM)
+      wc[n].imm_data = ibv_wc_read_imm_data(cq);
+    if (bq->ts_khz)
+      ts[n] = bw_hw_ns(ibv_wc_read_completion_ts(cq), bq->ts_khz);
+    n++;
+  } while (n < WC_BATCH && ibv_next_poll(cq) == 0);
+  ibv_end_poll(cq);
+  return n;
+}
+
+int bw_wait_completions(struct bandwidth_context *ctx, int qp_idx) {
+  struct bandwidth_qp *bq = &ctx->qps[qp_idx];
+  struct ibv_wc wc[WC_BATCH];
+  uint64_t ts[WC_BATCH];
+  int n =
+      bq->cq_ex ? bw_poll_ex(bq, wc, ts) : ibv_poll_cq(bq->cq, WC_BATCH, wc);
+  int ret = 0; // recv wr cnt
+  uint32_t slots[WC_BATCH];
+  uint32_t lens[WC_BATCH]; // --verify: message length, 0: nothing to check
+  uint64_t now = 0;
+  if (n > 0) {
+    bq->polled += n;
+    if (bq->hist && !bq->ts_khz)
+      now = bw_now_ns();
+  }
+  for (int i = 0; i < n; i++) {
+    // a shared cq carries the completions of all the worker's qps
+    struct bandwidth_qp *wq = ctx->srq ? bw_qp_lookup(ctx, wc[i].qp_num) : bq;
+
+    if (bq->ts_khz)
+      now = ts[i];
+
+    if (wc[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+              ibv_wc_status_str(wc[i].status), wc[i].status, (int)wc[i].wr_id);
+      return 0;
+    }
+
+    switch ((int)wc[i].wr_id) {
+    case BANDWIDTH_SEND_WRID:
+      // also retires the unsignaled wrs posted before this one
+      bw_sq_retire(wq, BW_WRID_COUNT(wc[i].wr_id), now);
+      break;
+
+    case BANDWIDTH_READ_WRID:
+      bw_sq_retire(wq, BW_WRID_COUNT(wc[i].wr_id), now);
+      wq->reads_done += BW_WRID_COUNT(wc[i].wr_id);
+      break;
+
+    case BANDWIDTH_CTRL_WRID:
+      bw_sq_retire(wq, 1, now);
+      break;
+
+    case BANDWIDTH_RECV_WRID:
+      if (wc[i].wc_flags & IBV_WC_WITH_IMM) {
+        uint32_t imm = ntohl(wc[i].imm_data);
+        if (imm & BW_IMM_CREDIT)
+          wq->credits += imm & ~BW_IMM_CREDIT;
+        else
+          wq->imm_received += imm;
+      }
+      wq->recvs++;
+      lens[ret] = wc[i].wc_flags & IBV_WC_WITH_IMM ? 0 : wc[i].byte_len;
+      slots[ret++] = BW_WRID_COUNT(wc[i].wr_id);
+      break;
+
+    default:
+      fprintf(stderr, "Completion for unknown wr_id %d\n", (int)wc[i].wr_id);
+      return 0;
+    }
+  }
+  if (ctx->verify && ctx->rx_ring && ret > 0)
+    bw_verify_recvs(ctx, bq, slots, lens, ret);
+  if (ctx->kv_buckets && ctx->rx_ring && ret > 0)
+    bw_kv_put(ctx, slots, lens, ret);
+  // the freed slots go back as one linked list
+  if (ret > 0 && bw_post_recv(ctx, qp_idx, slots, ret) < ret) {
+    fprintf(stderr, "Failed bw_post_recv\n");
+    return 0;
+  }
+  return ret;
+}
+
+static void usage(const char *argv0) {
+  printf("Usage:\n");
+  printf("  %s            start a server and wait for connection\n", argv0);
+  printf("  %s <host>     connect to server at <host>\n", argv0);
+  printf("\n");
+  printf("Options:\n");
+  printf("  -p, --port=<port>      listen on/connect to port <port> (default "
+         "18515)\n");
+  printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device "
+         "found)\n");
+  printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+  printf("  -s, --size=<size>      size of message to exchange (default "
+         "4096)\n");
   printf("  -m, --mtu=<size>       path MTU (default 1024)\n");
   printf("  -r, --rx-depth=<dep>   number of receives to post at a time "
          "(default 500)\n");
   printf("  -n, --iters=<iters>    number of exchanges (default 1000)\n");
   printf("  -l, --sl=<sl>          service level value\n");
-  printf("  -e, --events           sleep on CQ events (default poll)\n");
+  printf("  -e, --events           sleep on CQ events, same as --poll=event\n");
   printf("  -g, --gid-idx=<gid index> local port gid index\n");
+  printf("  -q, --qps=<num>        stripe writes over <num> QPs (default 1)\n");
+  printf("  -t, --threads=<num>    run <num> threads, each with its own QPs "
+         "(default 1)\n");
+  printf("  -c, --cpus=<list>      pin threads to cores, e.g. 0,2,4-7 "
+         "(default 0..threads-1)\n");
+  printf("  -b, --batch=<num>      link <num> writes per ibv_post_send "
+         "(default 1)\n");
+  printf("  -S, --signal=<num>     signal every <num>th write (default 1)\n");
+  printf("  -I, --inline=<size>    max inline data to request, 0 disables "
+         "(default %d)\n",
+         MAX_INLINE_SIZE);
+  printf("  -w, --window=<num>     sliding window of <num> writes per QP "
+         "instead of bursts (default off)\n");
+  printf("  -o, --op=<write|read|fadd|cas|send|ring|kv> RDMA operation "
+         "to measure\n"
+         "                         (default write)\n");
+  printf("  -W, --atomic-words=<num> words targeted by fadd/cas, 1 is fully "
+         "contended (default 1)\n");
+  printf("  -R, --rd-atomic=<num>  outstanding RDMA reads per QP (default "
+         "device limit)\n");
+  printf("  -P, --poll=<mode>      busy, event or hybrid completion polling "
+         "(default busy)\n");
+  printf("  -B, --poll-budget=<us> hybrid: spin <us> before sleeping "
+         "(default 100)\n");
+  printf("  -L, --lat-hist         record per-WR latency and print "
+         "percentiles\n");
+  printf("  -M, --clients=<num>    server: serve <num> clients at once "
+         "(default 1)\n");
+  printf("  -X, --srq              server: back all QPs with one SRQ and a "
+         "shared CQ per thread\n");
+  printf("  -C, --connect-threads=<num> threads moving QPs to RTS "
+         "(default online CPUs)\n");
+  printf("  -H, --mem=4k|2m|1g|odp big buffer pages (default 4k)\n");
+  printf("  -G, --reg-bench=<max>  time MR (de)registration up to <max> "
+         "bytes and exit\n");
+  printf("  -A, --slab-bench=<ops> compare per-request registration, the MR "
+         "cache and the\n"
+         "                         slab allocator over <ops> allocations and "
+         "exit\n");
+  printf("  -D, --bidir            both sides write into each other at once, "
+         "on both sides\n");
+  printf("  -E, --engine=legacy|ex post/poll with ibv_post_send/ibv_poll_cq "
+         "or ibv_wr_*/ibv_start_poll\n");
+  printf("  -z, --sizes=<list>     client: sizes to sweep, e.g. "
+         "64,4k-1m,8k-64k+8k (default 1-128k)\n");
+  printf("  -T, --duration=<sec>   client: run each size for <sec> seconds, "
+         "sized by a probe of --iters\n");
+  printf("  -F, --format=text|json|csv result format (default text)\n");
+  printf("  -N, --trials=<num>     client: measured runs per size, reported "
+         "as mean, ci95,\n"
+         "                         stddev, min and max (default 1)\n");
+  printf("  -K, --numa=auto|off|<node> bind buffers and threads to the "
+         "device's node, none\n"
+         "                         or <node> (default auto)\n");
+  printf("  -U, --stable=<pct>     client: warm up until two runs agree "
+         "within <pct>%%, 0: one\n"
+         "                         warmup run (default 2)\n");
+  printf("  -Y, --gather=<list>    client: with --op=write and -w, build "
+         "each message from\n"
+         "                         <list> fragments, e.g. 1-16, and compare "
+         "sge gather,\n"
+         "                         memcpy into a staging slot and a write "
+         "per fragment\n");
+  printf("  -V, --verify           client: with --op=send, crc32c-check "
+         "every message on the\n"
+         "                         server against an unchecked baseline "
+         "run\n");
+  printf("  -k, --kv-keys=<list>   with --op=kv, table sizes to sweep, on "
+         "both sides\n"
+         "                         (default 1k-16k)\n");
+}
+
+long long getMicrotime() {
+  struct timeval currentTime;
+  gettimeofday(&currentTime, NULL);
+  return currentTime.tv_sec * 1000000LL + currentTime.tv_usec;
+}
+
+static long long bw_thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// number of messages qp_idx carries when iters are striped over num_qps
+static int bw_qp_share(int iters, int num_qps, int qp_idx) {
+  return iters / num_qps + (qp_idx < iters % num_qps);
+}
+
+struct bw_stripe_state {
+  int iters;    // messages assigned to this qp
+  int sended;   // messages completed (credited back in window mode)
+  int inflight; // messages of the outstanding burst, 0 if idle
+  long long burst_time; // when the outstanding burst was posted
+  int posted;   // window mode: messages posted
+  int group;    // window mode: messages since the last write_with_imm
+  long long end_time;
+};
+
+// in window mode every group of window / BW_WINDOW_GROUPS writes ends with a
+// write_with_imm, so credits for earlier groups return while later ones are
+// still on the wire and the window never drains
+#define BW_WINDOW_GROUPS (4)
+
+struct bw_worker;
+struct bw_out;
+
+// shared by all workers, both sides must use the same values
+struct bw_params {
+  int iters;        // client: per step, or per probe with --duration
+  int tx_depth;
+  int batch;        // writes per doorbell
+  int signal_every; // writes per signaled completion
+  int window;       // writes the server may have unacknowledged, 0: bursts
+  int atomic_words; // fadd/cas target words
+  enum bw_op op;
+  enum bw_poll_mode poll_mode;
+  int poll_budget; // usec
+  size_t bm_max_size;
+  const size_t *sizes; // client: the sweep
+  int num_sizes;
+  const char *sizes_arg;
+  double duration;     // client: seconds per size, 0: a fixed iters
+  int trials;          // client: measured steps per size
+  double stable;       // client: warmup until two runs are this close
+  int warming;         // client: still in the warmup
+  int warmups;         // client: warmup steps sent
+  double warm_rate;    // client: ops/usec of the last warmup
+  int size_idx;        // client: size of the current step
+  int phase;           // client: step of the current size, the probe is 0
+  int timed_iters;     // client: iters of the trials after a probe
+  int verify;          // client: check the trials against a baseline step
+  const size_t *frags; // client: --gather fragment counts, NULL: off
+  int num_frags;
+  const char *frags_arg;
+  const size_t *kv_keys; // --op=kv client: key counts to sweep
+  int num_kv_keys;
+  const char *kv_keys_arg;
+  int step_frags;      // client: fragments per message of the step, 0: off
+  enum bw_gather gather; // client: strategy of the step
+  double baseline_rate; // --verify: rate of the unchecked step of the size
+  double *trial_rate;  // result of each trial of the current size
+  int trials_done, trials_cap;
+  size_t step_size;    // current step, as sent by the client
+  int step_flags;      // BW_STEP_*
+  int *client_iters;   // current step, iters of each client
+  int *ctrl_fds;       // control connection of each client
+  struct bw_out *out;
+  int num_threads;
+  int is_server;
+  int num_clients;    // server: clients served at once
+  int qps_per_client; // server: qps of client c are c * qps_per_client...
+  int bidir;          // both sides write, st is sent and st_rx received
+  pthread_barrier_t barrier; // client workers start every size together
+  struct bw_worker *workers;
+  struct bw_stripe_state *st; // indexed by qp
+  struct bw_stripe_state *st_rx;
+  double *client_bw;          // server: per-client result of a step
+};
+
+struct bw_worker {
+  struct bw_params *params;
+  struct bandwidth_context *ctx;
+  struct bandwidth_dest *my_dest;
+  struct bandwidth_dest *rem_dest;
+  int id;
+  int cpu;               // -1 if not pinned
+  int qp_begin, qp_end;  // qps owned by this worker
+  size_t buf_off;        // slice of bigbuf owned by this worker
+  size_t buf_len;
+  long long start_time;  // of the current size step
+  long long end_time;
+  struct bw_chain chain; // reused for the bursts of all owned qps
+  long long idle_since;  // start of the current run of empty polls, 0: busy
+  long long cpu_ns;      // thread cpu time of the current size step
+  long long rtt_sum;     // burst mode: post to reply, usec
+  long rtt_count;
+  long sleeps;           // times blocked on the completion channel
+  long long ping_ns;     // --op=ring: round trips of the timed records
+  long pings;
+  long long put_usec;    // --op=kv: the PUTs of the step
+  long long get_ns;      // --op=kv: latency of all GETs
+  long gets, hits, get_reads;
+  long cas_ok;           // --op=cas: cas that found their expected value
+  struct bw_hist *hist;  // per-wr latency of the owned qps, or NULL
+  pthread_t thread;
+};
+
+// parse "0,2,4-7" into an array of cpu ids, return the count or -1
+static int bw_parse_cpus(const char *list, int **cpus) {
+  int n = 0, cap = 16;
+  const char *p = list;
+
+  *cpus = malloc(cap * sizeof **cpus);
+  if (!*cpus)
+    return -1;
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 0), hi = lo;
+    if (end == p || lo < 0)
+      goto err;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 0);
+      if (end == p || hi < lo)
+        goto err;
+    }
+    for (long c = lo; c <= hi; c++) {
+      if (n == cap) {
+        int *tmp = realloc(*cpus, (cap *= 2) * sizeof **cpus);
+        if (!tmp)
+          goto err;
+        *cpus = tmp;
+      }
+      (*cpus)[n++] = c;
+    }
+    if (*end == ',')
+      end++;
+    else if (*end)
+      goto err;
+    p = end;
+  }
+  if (n > 0)
+    return n;
+err:
+  free(*cpus);
+  *cpus = NULL;
+  return -1;
+}
+
+// a size with an optional k, m or g suffix
+static int bw_parse_size(const char *p, char **end, size_t *size) {
+  unsigned long long v = strtoull(p, end, 0);
+
+  if (*end == p)
+    return -1;
+  switch (**end) {
+  case 'k':
+  case 'K':
+    v <<= 10;
+    (*end)++;
+    break;
+  case 'm':
+  case 'M':
+    v <<= 20;
+    (*end)++;
+    break;
+  case 'g':
+  case 'G':
+    v <<= 30;
+    (*end)++;
+    break;
+  }
+  *size = v;
+  return v ? 0 : -1;
+}
+
+// Parse "64,4k-1m,8k-64k+8k" into an array of sizes, return the count or
+// -1. A range doubles from its start, or adds the step after a '+'.
+static int bw_parse_sizes(const char *list, size_t **sizes) {
+  int n = 0, cap = 32;
+  const char *p = list;
+
+  *sizes = malloc(cap * sizeof **sizes);
+  if (!*sizes)
+    return -1;
+  while (*p) {
+    char *end;
+    size_t lo, hi, step = 0;
+    if (bw_parse_size(p, &end, &lo))
+      goto err;
+    hi = lo;
+    if (*end == '-') {
+      if (bw_parse_size(end + 1, &end, &hi) || hi < lo)
+        goto err;
+      if (*end == '+' && bw_parse_size(end + 1, &end, &step))
+        goto err;
+    }
+    for (size_t s = lo; s <= hi; s = step ? s + step : s * 2) {
+      if (n == cap) {
+        size_t *tmp = realloc(*sizes, (cap *= 2) * sizeof **sizes);
+        if (!tmp)
+          goto err;
+        *sizes = tmp;
+      }
+      (*sizes)[n++] = s;
+      if (s > hi - (step ? step : s)) // the next one would pass hi
+        break;
+    }
+    if (*end == ',')
+      end++;
+    else if (*end)
+      goto err;
+    p = end;
+  }
+  if (n > 0)
+    return n;
+err:
+  free(*sizes);
+  *sizes = NULL;
+  return -1;
+}
+
+// cpus of a numa node, from the same list format as --cpus
+static int bw_node_cpus(int node, int **cpus) {
+  char path[64], list[4096];
+  FILE *f;
+
+  snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+           node);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  if (!fgets(list, sizeof list, f)) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  list[strcspn(list, "\n")] = '\0';
+  return bw_parse_cpus(list, cpus);
+}
+
+static int bw_pin_thread(int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+// cqes reaped so far on the worker's qps
+static long bw_worker_polled(struct bw_worker *w) {
+  long n = 0;
+  for (int q = w->qp_begin; q < w->qp_end; q++)
+    n += w->ctx->qps[q].polled;
+  return n;
+}
+
+// Called after every pass over the worker's qps with the bw_worker_polled
+// count from before the pass. Once the pass found nothing (and, in hybrid
+// mode, the spin budget is used up) the cqs are armed; the next pass polls
+// them again to catch completions that raced with the arming, and only if
+// that also comes back empty the worker blocks on its channel.
+static int bw_worker_idle(struct bw_worker *w, long polled_before) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct ibv_cq *ev_cq;
+  struct bandwidth_qp *ev_bq;
+  int unarmed = 0;
+
+  if (p->poll_mode == BW_POLL_BUSY)
+    return 0;
+  if (bw_worker_polled(w) != polled_before) {
+    w->idle_since = 0;
+    return 0;
+  }
+  if (p->poll_mode == BW_POLL_HYBRID) {
+    long long now = getMicrotime();
+    if (w->idle_since == 0)
+      w->idle_since = now;
+    if (now - w->idle_since < p->poll_budget)
+      return 0;
+  }
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    struct bandwidth_qp *bq = &ctx->qps[q];
+    if (!bq->armed) {
+      if (ibv_req_notify_cq(bq->cq, 0)) {
+        fprintf(stderr, "Couldn't request CQ notification\n");
+        return 1;
+      }
+      bq->armed = 1;
+      unarmed++;
+    }
+  }
+  if (unarmed)
+    return 0;
+
+  if (ibv_get_cq_event(ctx->qps[w->qp_begin].channel, &ev_cq,
+                       (void **)&ev_bq)) {
+    fprintf(stderr, "Failed to get cq_event\n");
+    return 1;
+  }
+  ibv_ack_cq_events(ev_cq, 1);
+  ev_bq->armed = 0;
+  w->sleeps++;
+  w->idle_since = 0;
+  return 0;
+}
+
+// messages qp q carries per size step, every client stripes its own iters
+static int bw_qp_iters(struct bw_params *p, int q) {
+  return bw_qp_share(p->client_iters[q / p->qps_per_client],
+                     p->qps_per_client, q % p->qps_per_client);
+}
+
+// Poll the worker's cqs once. A shared cq is drained until it runs empty,
+// since one pass has to serve all of the worker's qps.
+static void bw_worker_poll(struct bw_worker *w) {
+  struct bandwidth_context *ctx = w->ctx;
+
+  if (ctx->srq) {
+    struct bandwidth_qp *bq = &ctx->qps[w->qp_begin];
+    long before;
+    do {
+      before = bq->polled;
+      bw_wait_completions(ctx, w->qp_begin);
+    } while (bq->polled - before == WC_BATCH);
+  } else {
+    for (int q = w->qp_begin; q < w->qp_end; q++)
+      bw_wait_completions(ctx, q);
+  }
+}
+
+// burst-and-wait over the worker's qps for one size step
+static int bw_client_run_size(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int tx_depth = p->tx_depth;
+  // slots of bw_size in the worker's slice; each qp starts at its own
+  // tx_depth slots so the stripes spread over the whole slice
+  size_t nslots = w->buf_len / bw_size;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    st[q].inflight = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  bw_chain_set_length(&w->chain, ctx, bw_size);
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int to_send = MIN(st[q].iters - st[q].sended, tx_depth);
+      // the server may answer before the last local cqe of the previous
+      // burst arrives, so also wait for its send queue slots to be retired
+      if (st[q].inflight == 0 && to_send > 0 &&
+          bq->sq_outstanding + to_send <= tx_depth) {
+        int ret = 0;
+        for (int i = 0; i < to_send && ret == 0; i++) {
+          size_t off =
+              w->buf_off +
+              ((size_t)(q - w->qp_begin) * tx_depth + i) % nslots * bw_size;
+          ret = bw_post_write(ctx, q, &w->chain, w->my_dest[q].buf_addr + off,
+                              w->rem_dest[q].buf_addr + off,
+                              w->rem_dest[q].rkey, i + 1 == to_send,
+                              htonl(to_send));
+        }
+        if (ret == 0)
+          ret = bw_flush_writes(ctx, q, &w->chain);
+        if (ret != 0) {
+          fprintf(stderr, "bw_post_write failed %d\n", ret);
+          return 1;
+        }
+        st[q].inflight = to_send;
+        st[q].burst_time = getMicrotime();
+      }
+      if ((st[q].inflight > 0 || bq->sq_outstanding > 0) &&
+          bw_wait_completions(ctx, q) > 0) {
+        w->rtt_sum += getMicrotime() - st[q].burst_time;
+        w->rtt_count++;
+        st[q].sended += st[q].inflight;
+        st[q].inflight = 0;
+        if (st[q].sended == st[q].iters) {
+          st[q].end_time = getMicrotime();
+          finished++;
+        }
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// Answer every write_with_imm of the worker's qps with a send. Counting per
+// qp keeps a client that is already a size ahead from being credited here.
+static int bw_server_run_size(struct bw_worker *w) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0; // bursts answered
+    if (st[q].iters == 0)
+      finished++;
+  }
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    bw_worker_poll(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      // every burst of up to tx_depth writes ends with one write_with_imm
+      int bursts = howmany(st[q].iters, p->tx_depth);
+      int take = MIN(bq->recvs - bq->recvs_used, bursts - st[q].sended);
+
+      for (int i = 0; i < take; i++) {
+        int ret = bw_post_send(ctx, q);
+        if (ret != 0) {
+          fprintf(stderr, "bw_post_send_with_imm failed %d\n", ret);
+          return 1;
+        }
+      }
+      bq->recvs_used += take;
+      st[q].sended += take;
+      if (take > 0 && st[q].sended == bursts) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// --verify: a fresh pattern in the slots the step sends from, each slot
+// closed by the crc32c of the rest. It is written before the clock starts
+// and never while a send may still read it.
+static void bw_fill_slots(struct bw_worker *w, size_t bw_size, size_t nslots) {
+  struct bw_params *p = w->params;
+  unsigned char *base = (unsigned char *)w->ctx->bigbuf + w->buf_off;
+  uint64_t seed = (uint64_t)w->id << 48 ^ (uint64_t)p->size_idx << 16 ^
+                  p->phase ^ bw_now_ns();
+
+  for (size_t s = 0; s < nslots; s++) {
+    unsigned char *slot = base + s * bw_size;
+    uint64_t x = seed ^ (s + 1) * 0x9e3779b97f4a7c15ULL; // xorshift64
+    size_t len = bw_size - 4;
+    uint32_t crc;
+
+    for (size_t i = 0; i < len; i += 8) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      memcpy(slot + i, &x, MIN(len - i, 8));
+    }
+    crc = htole32(bw_crc32c(slot, len));
+    memcpy(slot + len, &crc, 4);
+  }
+}
+
+// --gather: slots of a step, each message has step_frags fragments. The
+// first half of the worker's slice is split into one region per fragment
+// index, so the fragments of a message lie far apart; the second half holds
+// the staging slots of BW_GATHER_COPY. At the peer the message is one
+// contiguous slot whatever the strategy.
+static size_t bw_gather_slots(struct bw_worker *w, size_t bw_size) {
+  int n = w->params->step_frags;
+  size_t half = w->buf_len / 2;
+
+  return MIN(half / n / (bw_size / n + 1), half / bw_size);
+}
+
+static int bw_post_gather_msg(struct bw_worker *w, int q, size_t bw_size,
+                              size_t slot, int has_imm, uint32_t imm_data) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct ibv_sge sge[BW_GATHER_MAX];
+  int n = p->step_frags;
+  size_t half = w->buf_len / 2, region = half / n;
+  size_t len = bw_size / n, rest = bw_size % n, pos = 0;
+  char *local = (char *)ctx->bigbuf + w->buf_off;
+  uint64_t remote = w->rem_dest[q].buf_addr + w->buf_off + slot * bw_size;
+  uint32_t rkey = w->rem_dest[q].rkey;
+  int ret = 0;
+
+  for (int j = 0; j < n; j++) {
+    sge[j].addr = (uintptr_t)(local + j * region + slot * (len + 1));
+    sge[j].length = len + ((size_t)j < rest);
+    sge[j].lkey = ctx->bigmr->lkey;
+  }
+  switch (p->gather) {
+  case BW_GATHER_SGE:
+    return bw_post_gather(ctx, q, &w->chain, sge, n, remote, rkey, has_imm,
+                          imm_data);
+  case BW_GATHER_COPY: {
+    char *staging = local + half + slot * bw_size;
+    for (int j = 0; j < n; j++) {
+      memcpy(staging + pos, (void *)(uintptr_t)sge[j].addr, sge[j].length);
+      pos += sge[j].length;
+    }
+    return bw_post_write(ctx, q, &w->chain, (uintptr_t)staging, remote, rkey,
+                         has_imm, imm_data);
+  }
+  default: // the last fragment closes the message
+    for (int j = 0; j < n && ret == 0; j++) {
+      ret = bw_post_gather(ctx, q, &w->chain, &sge[j], 1, remote + pos, rkey,
+                           has_imm && j + 1 == n, imm_data);
+      pos += sge[j].length;
+    }
+    return ret;
+  }
+}
+
+// Keep up to window writes per qp unacknowledged by the server and refill
+// the send queue as soon as credits or send completions free slots. In send
+// mode every send takes one of the server's recvs, the window is its
+// rx_depth and each credit stands for reposted recvs.
+static int bw_client_run_window(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int group_len = MAX(p->window / BW_WINDOW_GROUPS, 1);
+  size_t nslots = p->step_frags ? bw_gather_slots(w, bw_size)
+                                 : w->buf_len / bw_size;
+  // wrs per message; a split message needs room for all of its fragments
+  int msg_wrs = p->step_frags && p->gather == BW_GATHER_SPLIT ? p->step_frags
+                                                               : 1;
+  size_t used = 0; // slots the step sends from
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    st[q].posted = 0;
+    st[q].group = 0;
+    ctx->qps[q].imm_received = 0;
+    if (st[q].iters == 0)
+      finished++;
+    used = MAX(used, (size_t)(q - w->qp_begin) * p->tx_depth + st[q].iters);
+  }
+  if (ctx->verify)
+    bw_fill_slots(w, bw_size, MIN(used, nslots));
+  bw_chain_set_length(&w->chain, ctx, bw_size);
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int ret = 0;
+
+      if (st[q].sended == st[q].iters)
+        continue;
+      while (ret == 0 && st[q].posted < st[q].iters &&
+             st[q].posted - st[q].sended < p->window &&
+             bq->sq_outstanding + w->chain.len + msg_wrs <= p->tx_depth) {
+        size_t slot =
+            ((size_t)(q - w->qp_begin) * p->tx_depth + st[q].posted) % nslots;
+        size_t off = w->buf_off + slot * bw_size;
+        if (p->op == BW_OP_SEND) {
+          ret = bw_post_msg(ctx, q, &w->chain, w->my_dest[q].buf_addr + off,
+                            0);
+        } else {
+          int has_imm = ++st[q].group == group_len ||
+                        st[q].posted + 1 == st[q].iters;
+          if (p->step_frags)
+            ret = bw_post_gather_msg(w, q, bw_size, slot, has_imm,
+                                     htonl(st[q].group));
+          else
+            ret = bw_post_write(
+                ctx, q, &w->chain, w->my_dest[q].buf_addr + off,
+                w->rem_dest[q].buf_addr + off, w->rem_dest[q].rkey, has_imm,
+                htonl(st[q].group));
+          if (has_imm)
+            st[q].group = 0;
+        }
+        st[q].posted++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_%s failed %d\n",
+                p->op == BW_OP_SEND ? "msg" : "write", ret);
+        return 1;
+      }
+
+      bw_wait_completions(ctx, q);
+      st[q].sended = bq->imm_received;
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// count the writes announced by every write_with_imm, or in send mode the
+// received sends whose recvs are reposted, and hand them back to the client
+// as credits
+static int bw_server_run_window(struct bw_worker *w) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    struct bandwidth_qp *bq = &ctx->qps[q];
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    bq->verified = bq->corrupt = 0;
+    bq->verify_bytes = bq->verify_ns = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    bw_worker_poll(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      long *got = p->op != BW_OP_WRITE ? &bq->recvs : &bq->imm_received;
+      long *used = p->op != BW_OP_WRITE ? &bq->recvs_used : &bq->imm_used;
+      int take = MIN(*got - *used, st[q].iters - st[q].sended);
+      int ret;
+
+      if (take <= 0)
+        continue;
+      ret = bw_post_credit(ctx, q, w->rem_dest[q].buf_addr,
+                           w->rem_dest[q].rkey, take);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_credit failed %d\n", ret);
+        return 1;
+      }
+      *used += take;
+      st[q].sended += take;
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// --op=ring client: build the next record of qp q in the local copy of the
+// ring and write it to the same place of the server's ring
+static int bw_ring_post(struct bw_worker *w, int q, size_t bw_size,
+                        size_t rec, uint32_t slots) {
+  struct bandwidth_qp *bq = &w->ctx->qps[q];
+  uint32_t seq = ++bq->ring_seq;
+  size_t pos = (size_t)((seq - bq->ring_base - 1) % slots) * rec;
+  char *local = (char *)(uintptr_t)w->my_dest[q].buf_addr + pos;
+  struct bw_ring_mark mark = {.len = htole32(bw_size), .seq = htole32(seq)};
+
+  memcpy(local, &mark, sizeof mark);
+  memcpy(local + rec - sizeof mark, &mark, sizeof mark);
+  return bw_post_write(w->ctx, q, &w->chain, (uintptr_t)local,
+                       w->rem_dest[q].buf_addr + pos, w->rem_dest[q].rkey, 0,
+                       0);
+}
+
+// Stream records into the server's rings, at most window of them (at most
+// a full ring) ahead of the head it writes back. Then bw_ring_pings records
+// go one at a time, from the post to the head covering it is one round
+// trip; half of it is reported as the one-way latency. Head updates raise
+// no cqe at the client, so this always spins.
+static int bw_client_run_ring(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  size_t rec = bw_ring_record(bw_size);
+  uint32_t slots = bw_ring_slots(ctx, rec);
+  // slots fit a ring, far below INT_MAX, and window bounds int counters
+  int window = (int)(p->window ? MIN((uint32_t)p->window, slots) : slots);
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    st[q].posted = 0;
+    ctx->qps[q].ring_base = ctx->qps[q].ring_seq;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  bw_chain_set_length(&w->chain, ctx, rec);
+  w->ping_ns = 0;
+  w->pings = 0;
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int ret = 0;
+
+      if (st[q].sended == st[q].iters)
+        continue;
+      while (ret == 0 && st[q].posted < st[q].iters &&
+             st[q].posted - st[q].sended < window &&
+             bq->sq_outstanding + w->chain.len < p->tx_depth) {
+        ret = bw_ring_post(w, q, bw_size, rec, slots);
+        st[q].posted++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_ring_post failed %d\n", ret);
+        return 1;
+      }
+
+      bw_wait_completions(ctx, q);
+      st[q].sended = MIN((uint32_t)le64toh(*bw_ring_head(ctx, &w->my_dest[q])) -
+                             bq->ring_base,
+                         (uint32_t)st[q].posted);
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+  }
+  w->end_time = getMicrotime();
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    struct bandwidth_qp *bq = &ctx->qps[q];
+    volatile uint64_t *head = bw_ring_head(ctx, &w->my_dest[q]);
+
+    for (int i = 0; i < bw_ring_pings(st[q].iters); i++) {
+      uint64_t start;
+
+      while (bq->sq_outstanding + 1 > p->tx_depth)
+        bw_wait_completions(ctx, q);
+      start = bw_now_ns();
+      if (bw_ring_post(w, q, bw_size, rec, slots) ||
+          bw_flush_writes(ctx, q, &w->chain)) {
+        fprintf(stderr, "bw_ring_post failed\n");
+        return 1;
+      }
+      while ((uint32_t)le64toh(*head) != bq->ring_seq)
+        ;
+      w->ping_ns += bw_now_ns() - start;
+      w->pings++;
+    }
+  }
+  return 0;
+}
+
+// --op=ring server: the next record of qp q is complete, or still on its
+// way, or -1 if its length can't be right
+static int bw_ring_ready(struct bw_worker *w, int q, size_t rec,
+                         uint32_t slots) {
+  struct bandwidth_qp *bq = &w->ctx->qps[q];
+  uint32_t seq = bq->ring_seq + 1;
+  char *r = (char *)(uintptr_t)w->my_dest[q].buf_addr +
+            (size_t)((seq - bq->ring_base - 1) % slots) * rec;
+  struct bw_ring_mark *head = (struct bw_ring_mark *)r, *tail;
+  size_t len;
+
+  if (le32toh(__atomic_load_n(&head->seq, __ATOMIC_ACQUIRE)) != seq)
+    return 0;
+  len = le32toh(head->len);
+  if (bw_ring_record(len) > rec)
+    return -1;
+  tail = (struct bw_ring_mark *)(r + bw_ring_record(len) - sizeof *tail);
+  return le32toh(__atomic_load_n(&tail->seq, __ATOMIC_ACQUIRE)) == seq;
+}
+
+// Consume the records of the worker's rings by polling their marks, then
+// write the head back. While records keep coming the head goes out every
+// quarter ring; once a ring is drained it goes out at once, so a lone
+// record is answered without delay. Only the head writes raise cqes.
+static int bw_server_run_ring(struct bw_worker *w) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  size_t rec = bw_ring_record(p->step_size);
+  uint32_t slots = bw_ring_slots(ctx, rec);
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0; // records consumed, pings included
+    st[q].end_time = 0;
+    ctx->qps[q].ring_base = ctx->qps[q].ring_seq;
+  }
+  w->start_time = getMicrotime();
+  w->end_time = w->start_time;
+  // a qp is done once all its records are consumed and the last head is out
+  while (finished < w->qp_end - w->qp_begin) {
+    bw_worker_poll(w);
+    finished = 0;
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int total = st[q].iters + bw_ring_pings(st[q].iters);
+      int ready = 0;
+
+      while (st[q].sended < total &&
+             (ready = bw_ring_ready(w, q, rec, slots)) > 0) {
+        bq->ring_seq++;
+        if (++st[q].sended == st[q].iters) {
+          st[q].end_time = getMicrotime();
+          w->end_time = MAX(w->end_time, st[q].end_time);
+        }
+        if (bq->ring_seq - bq->ring_acked >= MAX(slots / 4, 1))
+          break;
+      }
+      if (ready < 0) {
+        fprintf(stderr, "Bad record length on qp %d\n", q);
+        return 1;
+      }
+      if (bq->ring_seq != bq->ring_acked &&
+          bq->sq_outstanding < p->tx_depth &&
+          bw_post_head(ctx, q, &w->my_dest[q], &w->rem_dest[q])) {
+        fprintf(stderr, "bw_post_head failed\n");
+        return 1;
+      }
+      finished += st[q].sended == total && bq->ring_seq == bq->ring_acked;
+    }
+  }
+  return 0;
+}
+
+// --op=kv client, one GET in flight per op slot of a qp
+struct bw_kv_get {
+  uint64_t key;
+  uint64_t start_ns;
+  size_t bucket; // being read, or SIZE_MAX while the value is
+  size_t probes;
+};
+
+// Reads of a qp complete in the order they were posted, and every GET has
+// exactly one read in flight, so a fifo of op slots tells which GET each
+// completion belongs to.
+struct bw_kv_qp {
+  struct bw_kv_get *gets; // window op slots
+  int *fifo;              // op slots in the order of their reads
+  int head, len;
+  int *idle;              // op slots without a GET
+  int num_idle;
+  long reads_seen;
+};
+
+// GET op j of qp q reads into its own area of the worker's slice, a bucket
+// line followed by room for the value
+static char *bw_kv_area(struct bw_worker *w, int q, int window, int j,
+                        size_t bw_size) {
+  return (char *)w->ctx->bigbuf + w->buf_off +
+         ((size_t)(q - w->qp_begin) * window + j) *
+             (BW_KV_LINE + roundup(bw_size, BW_KV_LINE));
+}
+
+// read len bytes of the server's table into buf, behind the reads in flight
+static int bw_kv_read(struct bw_worker *w, int q, struct bw_kv_qp *kq,
+                      int window, int j, char *buf, size_t remote,
+                      size_t len) {
+  struct bw_chain *c = &w->chain;
+
+  kq->fifo[(kq->head + kq->len++) % window] = j;
+  w->get_reads++;
+  // reads of a step differ in length, so set it per wr; every one is
+  // signaled, its cqe moves the GET on
+  c->wr[c->len].sg_list->length = len;
+  return bw_post_read(w->ctx, q, c, (uintptr_t)buf,
+                      w->rem_dest[q].buf_addr + remote, w->rem_dest[q].rkey,
+                      1);
+}
+
+// PUT every key of the step once, striped over the qps, then run --iters
+// GETs of uniformly random keys with up to window of them in flight per qp.
+static int bw_client_run_kv(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int nq = w->qp_end - w->qp_begin;
+  uint64_t keys = p->client_iters[0];
+  size_t msg = sizeof(uint64_t) + bw_size;
+  size_t area = BW_KV_LINE + roundup(bw_size, BW_KV_LINE);
+  int put_window = MIN((size_t)p->window, w->buf_len / nq / msg);
+  int window = MIN((size_t)p->window, w->buf_len / nq / area);
+  struct bw_kv_qp *kqs = NULL;
+  struct bw_kv_get *gets = NULL;
+  int *slots = NULL;
+  uint64_t x = bw_now_ns() | 1; // xorshift64 state of the key picks
+  int finished = 0, ret = 1;
+
+  if (put_window < 1 || window < 1) {
+    fprintf(stderr, "A %zu byte value doesn't fit the buffer of a qp\n",
+            bw_size);
+    return 1;
+  }
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    st[q].posted = 0;
+    ctx->qps[q].imm_received = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  bw_chain_set_length(&w->chain, ctx, msg);
+  w->start_time = getMicrotime();
+  while (finished < nq) {
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+
+      if (st[q].sended == st[q].iters)
+        continue;
+      ret = 0;
+      while (ret == 0 && st[q].posted < st[q].iters &&
+             st[q].posted - st[q].sended < put_window &&
+             bq->sq_outstanding + w->chain.len < p->tx_depth) {
+        // a slot is written again only after the server credited its PUT
+        char *m = (char *)ctx->bigbuf + w->buf_off +
+                  ((size_t)(q - w->qp_begin) * put_window +
+                   st[q].posted % put_window) *
+                      msg;
+        uint64_t key = htole64((uint64_t)st[q].posted * p->qps_per_client +
+                               q + 1);
+        memcpy(m, &key, sizeof key);
+        // the last PUT leaves no unsignaled send behind, or the first GET's
+        // cqe would count it as a completed read
+        ret = bw_post_msg(ctx, q, &w->chain, (uintptr_t)m,
+                          st[q].posted + 1 == st[q].iters);
+        st[q].posted++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_msg failed %d\n", ret);
+        return 1;
+      }
+      bw_wait_completions(ctx, q);
+      st[q].sended = bq->imm_received;
+      if (st[q].sended == st[q].iters)
+        finished++;
+    }
+  }
+  w->put_usec = getMicrotime() - w->start_time;
+
+  kqs = calloc(nq, sizeof *kqs);
+  gets = calloc((size_t)nq * window, sizeof *gets);
+  slots = calloc((size_t)nq * window * 2, sizeof *slots);
+  if (!kqs || !gets || !slots) {
+    fprintf(stderr, "Couldn't allocate the GET state\n");
+    goto out;
+  }
+  w->gets = w->hits = w->get_reads = 0;
+  w->get_ns = 0;
+  finished = 0;
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    struct bw_kv_qp *kq = &kqs[q - w->qp_begin];
+
+    kq->gets = &gets[(size_t)(q - w->qp_begin) * window];
+    kq->fifo = &slots[(size_t)(q - w->qp_begin) * window * 2];
+    kq->idle = kq->fifo + window;
+    for (int j = 0; j < window; j++)
+      kq->idle[kq->num_idle++] = j;
+    kq->reads_seen = ctx->qps[q].reads_done;
+    st[q].iters = bw_qp_share(p->iters, p->qps_per_client, q);
+    st[q].sended = 0;
+    st[q].posted = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  w->start_time = getMicrotime();
+  while (finished < nq) {
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      struct bw_kv_qp *kq = &kqs[q - w->qp_begin];
+      long done;
+
+      if (st[q].sended == st[q].iters)
+        continue;
+      ret = 0;
+      // an idle op slot starts a GET with a read of the key's bucket
+      while (ret == 0 && st[q].posted < st[q].iters && kq->num_idle > 0 &&
+             bq->sq_outstanding + w->chain.len < p->tx_depth) {
+        int j = kq->idle[--kq->num_idle];
+        struct bw_kv_get *g = &kq->gets[j];
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        g->key = x % keys + 1;
+        g->start_ns = bw_now_ns();
+        g->bucket = bw_kv_hash(g->key, ctx->kv_buckets);
+        g->probes = 0;
+        st[q].posted++;
+        ret = bw_kv_read(w, q, kq, window, j,
+                         bw_kv_area(w, q, window, j, bw_size),
+                         g->bucket * BW_KV_LINE, BW_KV_LINE);
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_read failed %d\n", ret);
+        goto out;
+      }
+
+      bw_wait_completions(ctx, q);
+      done = bq->reads_done - kq->reads_seen;
+      kq->reads_seen = bq->reads_done;
+      for (; done > 0 && ret == 0; done--) {
+        int j = kq->fifo[kq->head];
+        struct bw_kv_get *g = &kq->gets[j];
+        char *buf = bw_kv_area(w, q, window, j, bw_size);
+        const struct bw_kv_bucket *b = (const struct bw_kv_bucket *)buf;
+        int full = 1, found = -1;
+
+        kq->head = (kq->head + 1) % window;
+        kq->len--;
+        if (g->bucket != SIZE_MAX) {
+          for (int k = 0; k < BW_KV_WAYS && found < 0; k++) {
+            if (b->e[k].key == g->key)
+              found = k;
+            else if (b->e[k].key == 0)
+              full = 0;
+          }
+          if (found >= 0) { // then the value
+            g->bucket = SIZE_MAX;
+            w->hits++;
+            ret = bw_kv_read(w, q, kq, window, j, buf + BW_KV_LINE,
+                             bw_kv_value_off(ctx->kv_buckets, b->e[found].slot,
+                                             b->e[found].len),
+                             b->e[found].len);
+            continue;
+          }
+          if (full && ++g->probes < ctx->kv_buckets) { // the next bucket
+            g->bucket = (g->bucket + 1) & (ctx->kv_buckets - 1);
+            ret = bw_kv_read(w, q, kq, window, j, buf,
+                             g->bucket * BW_KV_LINE, BW_KV_LINE);
+            continue;
+          }
+        }
+        // the value arrived, or the key isn't there
+        w->get_ns += bw_now_ns() - g->start_ns;
+        w->gets++;
+        kq->idle[kq->num_idle++] = j;
+        st[q].sended++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_read failed %d\n", ret);
+        goto out;
+      }
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+  }
+  w->end_time = getMicrotime();
+  ret = 0;
+out:
+  free(kqs);
+  free(gets);
+  free(slots);
+  return ret;
+}
+
+// Both peers run the window pipeline into each other's bigbuf at once. Per
+// qp the send half is bw_client_run_window and the receive half is
+// bw_server_run_window, on the same cq; credits carry BW_IMM_CREDIT to tell
+// them from the peer's write_with_imm. All counters are cumulative, so writes
+// of a peer that is already a size ahead are kept for the next step.
+static int bw_run_bidir(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st, *rx = p->st_rx;
+  int group_len = MAX(p->window / BW_WINDOW_GROUPS, 1);
+  size_t nslots = w->buf_len / bw_size;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = rx[q].iters = bw_qp_iters(p, q);
+    st[q].sended = st[q].posted = st[q].group = 0;
+    rx[q].sended = 0;
+    if (st[q].iters == 0)
+      finished += 2;
+  }
+  bw_chain_set_length(&w->chain, ctx, bw_size);
+  w->start_time = getMicrotime();
+  while (finished < 2 * (w->qp_end - w->qp_begin)) {
+    long polled = bw_worker_polled(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int take, ret = 0;
+
+      while (ret == 0 && st[q].posted < st[q].iters &&
+             st[q].posted - st[q].sended < p->window &&
+             bq->sq_outstanding + w->chain.len < p->tx_depth) {
+        size_t off =
+            w->buf_off +
+            ((size_t)(q - w->qp_begin) * p->tx_depth + st[q].posted) % nslots *
+                bw_size;
+        int has_imm = ++st[q].group == group_len ||
+                      st[q].posted + 1 == st[q].iters;
+        ret = bw_post_write(ctx, q, &w->chain, w->my_dest[q].buf_addr + off,
+                            w->rem_dest[q].buf_addr + off, w->rem_dest[q].rkey,
+                            has_imm, htonl(st[q].group));
+        if (has_imm)
+          st[q].group = 0;
+        st[q].posted++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_write failed %d\n", ret);
+        return 1;
+      }
+
+      bw_wait_completions(ctx, q);
+      if (st[q].sended < st[q].iters) {
+        st[q].sended = MIN(bq->credits - bq->credits_used, st[q].iters);
+        if (st[q].sended == st[q].iters) {
+          bq->credits_used += st[q].iters;
+          st[q].end_time = getMicrotime();
+          finished++;
+        }
+      }
+
+      // credits wait while our own writes fill the send queue
+      take = MIN(bq->imm_received - bq->imm_used, rx[q].iters - rx[q].sended);
+      if (take <= 0 || bq->sq_outstanding >= ctx->max_send_wr)
+        continue;
+      ret = bw_post_credit(ctx, q, w->rem_dest[q].buf_addr,
+                           w->rem_dest[q].rkey, BW_IMM_CREDIT | take);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_credit failed %d\n", ret);
+        return 1;
+      }
+      bq->imm_used += take;
+      rx[q].sended += take;
+      if (rx[q].sended == rx[q].iters) {
+        rx[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// the local slot of qp q's i-th read or atomic
+static inline size_t bw_read_off(struct bw_worker *w, int q, int i,
+                                 size_t bw_size, size_t nslots) {
+  return w->buf_off +
+         ((size_t)(q - w->qp_begin) * w->params->tx_depth + i) % nslots *
+             bw_size;
+}
+
+// Keep up to window reads or atomics per qp outstanding, the HCA itself lets
+// max_rd_atomic of them be on the wire. Once a qp's share has completed, a
+// zero-length write_with_imm tells the otherwise idle server. Atomics walk
+// over atomic_words target words, qp q starting at word q: a single word is
+// fully contended, one per outstanding op is fully spread. The words start
+// at zero and a qp's cas on its k-th visit of a word expects k, so every
+// cas of a lone qp succeeds and the others count the interference.
+static int bw_client_run_read(struct bw_worker *w, size_t bw_size) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int window = p->window ? p->window : p->tx_depth;
+  size_t nslots = w->buf_len / bw_size;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    st[q].posted = 0;
+    ctx->qps[q].reads_done = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  bw_chain_set_length(&w->chain, ctx, bw_size);
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int ret = 0;
+
+      if (st[q].sended == st[q].iters)
+        continue;
+      while (ret == 0 && st[q].posted < st[q].iters &&
+             st[q].posted - st[q].sended < window &&
+             bq->sq_outstanding + w->chain.len < p->tx_depth) {
+        size_t off = bw_read_off(w, q, st[q].posted, bw_size, nslots);
+        // signal the read that fills the window or ends the share, nothing
+        // else would retire it
+        int force_signal = st[q].posted + 1 == st[q].iters ||
+                           st[q].posted + 1 - st[q].sended == window;
+        if (p->op == BW_OP_READ)
+          ret = bw_post_read(ctx, q, &w->chain, w->my_dest[q].buf_addr + off,
+                             w->rem_dest[q].buf_addr + off,
+                             w->rem_dest[q].rkey, force_signal);
+        else
+          ret = bw_post_atomic(
+              ctx, q, &w->chain, p->op, w->my_dest[q].buf_addr + off,
+              w->rem_dest[q].buf_addr +
+                  (q + st[q].posted) % p->atomic_words * BW_ATOMIC_STRIDE,
+              w->rem_dest[q].rkey, st[q].posted / p->atomic_words,
+              force_signal);
+        st[q].posted++;
+      }
+      if (ret == 0)
+        ret = bw_flush_writes(ctx, q, &w->chain);
+      if (ret != 0) {
+        fprintf(stderr, "bw_post_%s failed %d\n",
+                p->op == BW_OP_READ ? "read" : "atomic", ret);
+        return 1;
+      }
+
+      bw_wait_completions(ctx, q);
+      // the old values of the completed cas are in their slots by now
+      for (; p->op == BW_OP_CAS && st[q].sended < bq->reads_done;
+           st[q].sended++) {
+        uint64_t *old = (uint64_t *)(uintptr_t)(
+            w->my_dest[q].buf_addr +
+            bw_read_off(w, q, st[q].sended, bw_size, nslots));
+        if (*old == (uint64_t)st[q].sended / p->atomic_words)
+          w->cas_ok++;
+      }
+      st[q].sended = bq->reads_done;
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+        ret = bw_post_credit(ctx, q, w->rem_dest[q].buf_addr,
+                             w->rem_dest[q].rkey, st[q].iters);
+        if (ret != 0) {
+          fprintf(stderr, "bw_post_credit failed %d\n", ret);
+          return 1;
+        }
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// the server's cpu takes no part in reads, it only waits for the notice
+// that each qp's share is done
+static int bw_server_run_read(struct bw_worker *w) {
+  struct bw_params *p = w->params;
+  struct bandwidth_context *ctx = w->ctx;
+  struct bw_stripe_state *st = p->st;
+  int finished = 0;
+
+  for (int q = w->qp_begin; q < w->qp_end; q++) {
+    st[q].iters = bw_qp_iters(p, q);
+    st[q].sended = 0;
+    if (st[q].iters == 0)
+      finished++;
+  }
+  w->start_time = getMicrotime();
+  while (finished < w->qp_end - w->qp_begin) {
+    long polled = bw_worker_polled(w);
+    bw_worker_poll(w);
+    for (int q = w->qp_begin; q < w->qp_end; q++) {
+      struct bandwidth_qp *bq = &ctx->qps[q];
+      int take =
+          MIN(bq->imm_received - bq->imm_used, st[q].iters - st[q].sended);
+
+      if (take <= 0)
+        continue;
+      bq->imm_used += take;
+      st[q].sended += take;
+      if (st[q].sended == st[q].iters) {
+        st[q].end_time = getMicrotime();
+        finished++;
+      }
+    }
+    if (bw_worker_idle(w, polled))
+      return 1;
+  }
+  w->end_time = getMicrotime();
+  return 0;
+}
+
+// One named value of a result record or of the run's parameters
+struct bw_field {
+  char key[32];
+  char val[128];
+  int quote; // json: a string, not a number
+};
+
+// Result records. In text mode every value goes straight to stdout through
+// its own format, which also carries the tabs and the unit, so the lines
+// look as they always did. Json and csv collect the values of a step under
+// their keys and write one flat record per reported step.
+struct bw_out {
+  enum bw_format fmt;
+  struct bw_field *params;
+  int num_params, params_cap;
+  struct bw_field *row;
+  int row_len, row_cap;
+  int rows; // records written
+};
+
+static void bw_out_addv(struct bw_field **f, int *len, int *cap,
+                        const char *key, int quote, const char *fmt,
+                        va_list ap) {
+  if (*len == *cap) {
+    int new_cap = *cap ? *cap * 2 : 32;
+    struct bw_field *tmp = realloc(*f, new_cap * sizeof **f);
+    if (!tmp) {
+      fprintf(stderr, "Couldn't allocate the output record\n");
+      exit(1);
+    }
+    *f = tmp;
+    *cap = new_cap;
+  }
+  snprintf((*f)[*len].key, sizeof (*f)[*len].key, "%s", key);
+  vsnprintf((*f)[*len].val, sizeof (*f)[*len].val, fmt, ap);
+  (*f)[*len].quote = quote;
+  (*len)++;
+}
+
+// record a parameter of the run, before bw_out_begin
+static void bw_out_param(struct bw_out *o, const char *key, int quote,
+                         const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  bw_out_addv(&o->params, &o->num_params, &o->params_cap, key, quote, fmt,
+              ap);
+  va_end(ap);
+}
+
+static void bw_out_field(struct bw_out *o, const char *key, const char *fmt,
+                         ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  bw_out_addv(&o->row, &o->row_len, &o->row_cap, key, 0, fmt, ap);
+  va_end(ap);
+}
+
+// text: printf(text, v), json/csv: key = v; a NULL text is json/csv only
+static void bw_out_int(struct bw_out *o, const char *key, const char *text,
+                       long long v) {
+  if (o->fmt == BW_FMT_TEXT) {
+    if (text)
+      printf(text, v);
+  } else {
+    bw_out_field(o, key, "%lld", v);
+  }
+}
+
+static void bw_out_num(struct bw_out *o, const char *key, const char *text,
+                       double v) {
+  if (o->fmt == BW_FMT_TEXT) {
+    if (text)
+      printf(text, v);
+  } else if (!isfinite(v)) { // a step too short to time
+    bw_out_field(o, key, o->fmt == BW_FMT_JSON ? "null" : "");
+  } else {
+    bw_out_field(o, key, "%.10g", v);
+  }
+}
+
+static void bw_out_str(struct bw_out *o, const char *key, const char *text,
+                       const char *v) {
+  if (o->fmt == BW_FMT_TEXT) {
+    if (text)
+      printf(text, v);
+  } else {
+    bw_out_field(o, key, "%s", v);
+    o->row[o->row_len - 1].quote = 1;
+  }
+}
+
+// text only, labels and line breaks inside a record
+static void bw_out_text(struct bw_out *o, const char *fmt, ...) {
+  va_list ap;
+
+  if (o->fmt != BW_FMT_TEXT)
+    return;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+static void bw_out_json_fields(const struct bw_field *f, int n) {
+  for (int i = 0; i < n; i++)
+    printf("%s\"%s\":%s%s%s", i ? "," : "", f[i].key, f[i].quote ? "\"" : "",
+           f[i].val, f[i].quote ? "\"" : "");
+}
+
+// write the parameters, once before the first record
+static void bw_out_begin(struct bw_out *o) {
+  if (o->fmt == BW_FMT_JSON) {
+    printf("{\"params\":{");
+    bw_out_json_fields(o->params, o->num_params);
+    printf("},\n\"results\":[");
+  } else if (o->fmt == BW_FMT_CSV) {
+    for (int i = 0; i < o->num_params; i++)
+      printf("# %s=%s\n", o->params[i].key, o->params[i].val);
+  }
+  fflush(stdout);
+}
+
+// finish the record of a step
+static void bw_out_end(struct bw_out *o) {
+  if (o->fmt == BW_FMT_TEXT) {
+    printf("\n");
+  } else if (o->fmt == BW_FMT_JSON) {
+    printf("%s\n{", o->rows ? "," : "");
+    bw_out_json_fields(o->row, o->row_len);
+    printf("}");
+  } else {
+    // the fields of a run don't change between steps, so one header
+    if (o->rows == 0)
+      for (int i = 0; i < o->row_len; i++)
+        printf("%s%s", i ? "," : "", o->row[i].key);
+    if (o->rows == 0)
+      printf("\n");
+    for (int i = 0; i < o->row_len; i++)
+      printf("%s%s", i ? "," : "", o->row[i].val);
+    printf("\n");
+  }
+  o->rows++;
+  o->row_len = 0;
+  fflush(stdout);
+}
+
+static void bw_out_close(struct bw_out *o) {
+  if (o->fmt == BW_FMT_JSON)
+    printf("\n]}\n");
+  free(o->params);
+  free(o->row);
+}
+
+#define BW_WARMUP_MAX 16 // warmup runs before giving up on a stable rate
+
+// results of the trials of one size
+struct bw_stats {
+  double mean;
+  double stddev;
+  double ci; // half width of the 95% confidence interval of the mean
+  double min, max;
+  int n, kept; // trials, and those left after dropping the outliers
+};
+
+// two-sided 95% quantiles of Student's t for 1..30 degrees of freedom
+static const double bw_t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+static int bw_compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Mean, stddev and confidence interval of n trials. Trials further than
+// 3 scaled median absolute deviations from the median are dropped first, so
+// one run disturbed by another job doesn't move the mean.
+static void bw_trial_stats(double *x, int n, struct bw_stats *st) {
+  double *dev = malloc(n * sizeof *dev);
+  double median, mad = 0, sum = 0, sum_sq = 0;
+
+  qsort(x, n, sizeof *x, bw_compare_double);
+  median = n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+  if (dev) {
+    for (int i = 0; i < n; i++)
+      dev[i] = fabs(x[i] - median);
+    qsort(dev, n, sizeof *dev, bw_compare_double);
+    mad = n % 2 ? dev[n / 2] : (dev[n / 2 - 1] + dev[n / 2]) / 2;
+    free(dev);
+  }
+  st->n = n;
+  st->kept = 0;
+  st->min = x[n - 1];
+  st->max = x[0];
+  for (int i = 0; i < n; i++) {
+    // 1.4826 * mad estimates the stddev of normally distributed trials
+    if (mad > 0 && fabs(x[i] - median) > 3 * 1.4826 * mad)
+      continue;
+    st->kept++;
+    sum += x[i];
+    sum_sq += x[i] * x[i];
+    st->min = MIN(st->min, x[i]);
+    st->max = MAX(st->max, x[i]);
+  }
+  st->mean = sum / st->kept;
+  st->stddev = st->kept > 1 ? sqrt(MAX(sum_sq - sum * st->mean, 0.0) /
+                                   (st->kept - 1))
+                            : 0;
+  st->ci = st->kept > 1 ? (st->kept <= 31 ? bw_t95[st->kept - 2] : 1.960) *
+                              st->stddev / sqrt(st->kept)
+                        : 0;
+}
+
+// Keep the result of a trial. Returns 1 on the last trial of the size, with
+// the stats of all of them, after which the size is reported.
+static int bw_trial_add(struct bw_params *p, double rate, struct bw_stats *st) {
+  if (p->step_flags & BW_STEP_BASELINE) {
+    p->baseline_rate = rate;
+    return 0;
+  }
+  if (p->trials_done == p->trials_cap) {
+    int cap = p->trials_cap ? p->trials_cap * 2 : 16;
+    double *tmp = realloc(p->trial_rate, cap * sizeof *tmp);
+    if (!tmp) {
+      fprintf(stderr, "Couldn't allocate the trial results\n");
+      exit(1);
+    }
+    p->trial_rate = tmp;
+    p->trials_cap = cap;
+  }
+  p->trial_rate[p->trials_done++] = rate;
+  if (!(p->step_flags & BW_STEP_REPORT))
+    return 0;
+  bw_trial_stats(p->trial_rate, p->trials_done, st);
+  p->trials_done = 0;
+  return 1;
+}
+
+// the spread of the trials, after the mean they describe
+static void bw_out_stats(struct bw_out *o, const struct bw_stats *st) {
+  if (st->n < 2)
+    return;
+  bw_out_num(o, "ci95", "\t%.4f\tci95", st->ci);
+  bw_out_num(o, "stddev", "\t%.4f\tstddev", st->stddev);
+  bw_out_num(o, "min", "\t%.4f\tmin", st->min);
+  bw_out_num(o, "max", "\t%.4f\tmax", st->max);
+  bw_out_int(o, "trials_kept", "\t%lld", st->kept);
+  bw_out_int(o, "trials", "/%lld\ttrials", st->n);
+}
+
+// --verify: the cost of the checks. The server adds the rate and the share
+// of its cpu they took, and the messages that failed; both sides report
+// how much slower the trials ran than the unchecked step before them.
+static void bw_out_verify(struct bw_params *p, double rate, long long cpu_ns) {
+  struct bw_out *o = p->out;
+
+  if (!(p->step_flags & BW_STEP_VERIFY))
+    return;
+  if (p->is_server) {
+    struct bandwidth_context *ctx = p->workers[0].ctx;
+    uint64_t bytes = 0, ns = 0;
+    long long verified = 0, corrupt = 0;
+
+    for (int q = 0; q < ctx->num_qps; q++) {
+      verified += ctx->qps[q].verified;
+      corrupt += ctx->qps[q].corrupt;
+      bytes += ctx->qps[q].verify_bytes;
+      ns += ctx->qps[q].verify_ns;
+    }
+    bw_out_num(o, "verify_gib_per_s", "\t%.4f\tverify-GiB/s",
+               ns ? (double)bytes / ns : 0.0);
+    bw_out_num(o, "verify_cpu_share", "\t%.4f\tverify-cpu",
+               cpu_ns ? (double)ns / cpu_ns : 0.0);
+    bw_out_int(o, "verified", NULL, verified);
+    bw_out_int(o, "corrupt", "\t%lld\tcorrupt", corrupt);
+  }
+  bw_out_num(o, "lost_pct", "\t%.2f\t%%lost",
+             p->baseline_rate > 0 ? 100 * (1 - rate / p->baseline_rate)
+                                  : NAN);
+}
+
+// wall time of the last step, from the first worker starting to the last
+// one finishing
+static long long bw_step_usec(struct bw_params *p) {
+  long long start_time = p->workers[0].start_time;
+  long long end_time = p->workers[0].end_time;
+
+  for (int t = 0; t < p->num_threads; t++) {
+    start_time = MIN(start_time, p->workers[t].start_time);
+    end_time = MAX(end_time, p->workers[t].end_time);
+  }
+  return end_time - start_time;
+}
+
+// Client: pick the next step and send it to the server. The warmup
+// repeats the first size until two runs in a row agree within --stable, up
+// to BW_WARMUP_MAX runs. Then every size runs --trials measured steps. With
+// --duration a probe of --iters comes first, its rate sizes the trials.
+// With --verify an unchecked baseline step runs before the checked trials.
+static int bw_send_step(struct bw_params *p) {
+  struct bw_wire_step wire;
+  // every size runs once per --gather fragment count and strategy, or
+  // per --kv-keys count
+  int variants = p->frags     ? p->num_frags * BW_GATHER_MODES
+                 : p->kv_keys ? p->num_kv_keys
+                              : 1;
+  int probe = p->duration > 0;
+  int iters = p->iters;
+  int flags = 0;
+
+  if (p->warming) {
+    if (p->warmups > 0) {
+      long long usec = bw_step_usec(p);
+      double rate = usec > 0 ? (double)p->client_iters[0] / usec : 0;
+      int stable = p->stable <= 0 ||
+                   (p->warmups > 1 &&
+                    fabs(rate - p->warm_rate) <= p->stable * p->warm_rate);
+      p->warm_rate = rate;
+      if (stable || p->warmups == BW_WARMUP_MAX)
+        p->warming = 0;
+    }
+    if (p->warming)
+      p->warmups++;
+  } else if (++p->phase == probe + p->verify + p->trials) {
+    p->size_idx++;
+    p->phase = 0;
+  }
+
+  if (p->warming) {
+    p->step_size = p->sizes[0];
+  } else if (p->size_idx >= p->num_sizes * variants) {
+    flags = BW_STEP_END;
+    p->step_size = 0;
+  } else {
+    p->step_size = p->sizes[p->size_idx / variants];
+    if (probe && p->phase == 1) {
+      long long usec = bw_step_usec(p);
+      double n = usec > 0 ? p->iters * p->duration * 1e6 / usec : p->iters;
+      p->timed_iters = n < INT_MAX / 2 ? MAX((int)n, 1) : INT_MAX / 2;
+    }
+    if (!probe || p->phase > 0) {
+      flags = BW_STEP_TRIAL;
+      if (p->verify)
+        flags |= p->phase == probe ? BW_STEP_BASELINE : BW_STEP_VERIFY;
+      if (p->phase == probe + p->verify + p->trials - 1)
+        flags |= BW_STEP_REPORT;
+      if (probe)
+        iters = p->timed_iters;
+    }
+  }
+  // --op=kv: the server takes as many PUTs as the step has keys
+  if (p->kv_keys && !(flags & BW_STEP_END))
+    iters = p->kv_keys[p->size_idx % variants];
+  if (p->frags) {
+    int v = p->size_idx % variants;
+    p->step_frags = MIN(p->frags[v / BW_GATHER_MODES], p->step_size);
+    p->gather = v % BW_GATHER_MODES;
+  }
+  p->step_flags = flags;
+  p->client_iters[0] = iters;
+
+  wire.size = htobe64(p->step_size);
+  wire.iters = htonl(iters);
+  wire.flags = htonl(flags);
+  if (bw_write_full(p->ctrl_fds[0], &wire, sizeof wire) != sizeof wire) {
+    fprintf(stderr, "Couldn't send the next step\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Server: take the next step from every client. All of them have to run
+// the same sweep, but each one may bring its own iteration count.
+static int bw_recv_step(struct bw_params *p) {
+  for (int c = 0; c < p->num_clients; c++) {
+    struct bw_wire_step wire;
+    size_t size;
+    int flags;
+
+    if (bw_read_full(p->ctrl_fds[c], &wire, sizeof wire) != sizeof wire) {
+      fprintf(stderr, "Lost the control connection of client %d\n", c);
+      return 1;
+    }
+    size = be64toh(wire.size);
+    flags = ntohl(wire.flags);
+    if (c == 0) {
+      p->step_size = size;
+      p->step_flags = flags;
+    } else if (size != p->step_size || flags != p->step_flags) {
+      fprintf(stderr, "Client %d runs another sweep than client 0\n", c);
+      return 1;
+    }
+    p->client_iters[c] = ntohl(wire.iters);
+  }
+  if (!(p->step_flags & BW_STEP_END) && p->step_size > p->bm_max_size) {
+    fprintf(stderr, "Size %zu is above the server's largest size %zu\n",
+            p->step_size, p->bm_max_size);
+    return 1;
+  }
+  return 0;
+}
+
+// Every cas step starts from zeroed target words. Atomics pass the server's
+// cpu by, so the client waits for the reset before its first cas.
+static int bw_cas_reset(struct bw_params *p, struct bandwidth_context *ctx) {
+  char ack = 0;
+
+  if (!p->is_server) {
+    if (bw_read_full(p->ctrl_fds[0], &ack, 1) != 1) {
+      fprintf(stderr, "Lost the control connection\n");
+      return 1;
+    }
+    return 0;
+  }
+  memset(ctx->bigbuf, 0, (size_t)p->atomic_words * BW_ATOMIC_STRIDE);
+  for (int c = 0; c < p->num_clients; c++) {
+    if (bw_write_full(p->ctrl_fds[c], &ack, 1) != 1) {
+      fprintf(stderr, "Lost the control connection of client %d\n", c);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// merge the results of all workers into one line per size
+static void bw_report_size(struct bw_params *p, int num_qps, size_t bw_size) {
+  struct bw_out *o = p->out;
+  long long start_time = p->workers[0].start_time;
+  long long end_time = p->workers[0].end_time;
+  int iters = p->client_iters[0];
+  size_t total_size = iters * bw_size;
+  long long cpu_ns = 0, rtt_sum = 0, ping_ns = 0;
+  long rtt_count = 0, sleeps = 0, pings = 0, cas_ok = 0;
+  int atomic = p->op == BW_OP_FADD || p->op == BW_OP_CAS;
+  struct bw_stats st;
+  double mpps;
+
+  for (int t = 0; t < p->num_threads; t++) {
+    start_time = MIN(start_time, p->workers[t].start_time);
+    end_time = MAX(end_time, p->workers[t].end_time);
+    cpu_ns += p->workers[t].cpu_ns;
+    rtt_sum += p->workers[t].rtt_sum;
+    rtt_count += p->workers[t].rtt_count;
+    sleeps += p->workers[t].sleeps;
+    ping_ns += p->workers[t].ping_ns;
+    pings += p->workers[t].pings;
+    cas_ok += p->workers[t].cas_ok;
+  }
+  // the trials are compared in Mops/s or GiB/s, the rates are their means
+  // and the remaining columns are those of the last trial
+  if (!bw_trial_add(p,
+                    atomic ? (double)iters / (end_time - start_time)
+                           : (double)total_size / (end_time - start_time) /
+                                 1000.0,
+                    &st))
+    return;
+  mpps = atomic ? st.mean : st.mean * 1000.0 / bw_size;
+  bw_out_int(o, "size", "%lld", bw_size);
+  if (p->step_frags) {
+    bw_out_str(o, "gather", "\t%s", bw_gather_names[p->gather]);
+    bw_out_int(o, "frags", "\t%lld\tfrags", p->step_frags);
+  }
+  bw_out_int(o, "iters", NULL, iters);
+  bw_out_num(o, "usec", NULL, end_time - start_time);
+  if (atomic) {
+    bw_out_num(o, "mops", "\t%.4f\tMops/s", st.mean);
+    bw_out_stats(o, &st);
+    bw_out_int(o, "atomic_words", "\t%lld\twords", p->atomic_words);
+    if (p->op == BW_OP_CAS)
+      bw_out_int(o, "cas_ok", "\t%lld\tcas-ok", cas_ok);
+  } else {
+    bw_out_num(o, "gib_per_s", "\t%.4f\tGiB/s", st.mean);
+    bw_out_stats(o, &st);
+    bw_out_num(o, "mpps", "\t%.4f\tMpps", mpps);
+  }
+  // with a single read in flight per qp the time per read is its latency
+  if (p->op != BW_OP_WRITE && p->op != BW_OP_SEND && p->op != BW_OP_RING &&
+      p->window == 1)
+    bw_out_num(o, "lat_usec", "\t%.2f\tusec", num_qps / mpps);
+  // a ring record from the client's post to the server finding it
+  if (p->op == BW_OP_RING)
+    bw_out_num(o, "oneway_usec", "\t%.2f\tone-way-usec",
+               pings ? ping_ns / 2000.0 / pings : NAN);
+  // client cpu seconds per transferred GiB, and the mean burst round trip;
+  // its growth over --poll=busy is the latency added by sleeping
+  bw_out_num(o, "cpu_s_per_gib", "\t%.4f\tcpu-s/GiB",
+             (double)cpu_ns / total_size);
+  bw_out_verify(p, st.mean, cpu_ns);
+  if (rtt_count)
+    bw_out_num(o, "rtt_usec", "\t%.2f\trtt-usec", (double)rtt_sum / rtt_count);
+  if (p->poll_mode != BW_POLL_BUSY)
+    bw_out_int(o, "sleeps", "\t%lld\tsleeps", sleeps);
+  if (p->workers[0].hist) {
+    static struct bw_hist h; // too big for the stack of a worker
+    memset(&h, 0, sizeof h);
+    for (int t = 0; t < p->num_threads; t++)
+      bw_hist_merge(&h, p->workers[t].hist);
+    bw_out_text(o, "\n\tlat-usec");
+    bw_out_num(o, "p50_usec", "\tp50 %.2f",
+               bw_hist_percentile(&h, 0.50) / 1000.0);
+    bw_out_num(o, "p90_usec", "\tp90 %.2f",
+               bw_hist_percentile(&h, 0.90) / 1000.0);
+    bw_out_num(o, "p99_usec", "\tp99 %.2f",
+               bw_hist_percentile(&h, 0.99) / 1000.0);
+    bw_out_num(o, "p999_usec", "\tp99.9 %.2f",
+               bw_hist_percentile(&h, 0.999) / 1000.0);
+    bw_out_num(o, "max_usec", "\tmax %.2f", h.max / 1000.0);
+  }
+  if (num_qps > 1)
+    for (int q = 0; q < num_qps; q++) {
+      char key[32];
+
+      snprintf(key, sizeof key, "qp%d_gib_per_s", q);
+      bw_out_text(o, "\n\tqp%d", q);
+      bw_out_num(o, key, "\t%.4f\tGiB/s",
+                 p->st[q].iters ? (double)p->st[q].iters * bw_size /
+                                      (p->st[q].end_time - start_time) / 1000.0
+                                : 0.0);
+    }
+  bw_out_end(o);
 }
 
-long long getMicrotime() {
-  struct timeval currentTime;
-  gettimeofday(&currentTime, NULL);
-  return currentTime.tv_sec * 1000000LL + currentTime.tv_usec;
+// --op=kv: the GET rate is what the trials compare, the PUT rate of the
+// step's table fill is printed next to it
+static void bw_report_kv(struct bw_params *p, size_t bw_size) {
+  struct bw_out *o = p->out;
+  long long start_time = p->workers[0].start_time;
+  long long end_time = p->workers[0].end_time;
+  long long put_usec = 0, get_ns = 0;
+  long gets = 0, hits = 0, get_reads = 0;
+  int keys = p->client_iters[0];
+  struct bw_stats st;
+
+  for (int t = 0; t < p->num_threads; t++) {
+    start_time = MIN(start_time, p->workers[t].start_time);
+    end_time = MAX(end_time, p->workers[t].end_time);
+    put_usec = MAX(put_usec, p->workers[t].put_usec);
+    get_ns += p->workers[t].get_ns;
+    gets += p->workers[t].gets;
+    hits += p->workers[t].hits;
+    get_reads += p->workers[t].get_reads;
+  }
+  if (!bw_trial_add(p, (double)gets / (end_time - start_time), &st))
+    return;
+  bw_out_int(o, "size", "%lld", bw_size);
+  bw_out_int(o, "keys", "\t%lld\tkeys", keys);
+  bw_out_int(o, "gets", "\t%lld\tgets", gets);
+  bw_out_num(o, "usec", NULL, end_time - start_time);
+  bw_out_num(o, "mgets", "\t%.4f\tMgets/s", st.mean);
+  bw_out_stats(o, &st);
+  bw_out_num(o, "get_usec", "\t%.2f\tget-usec",
+             gets ? get_ns / 1000.0 / gets : NAN);
+  // 2.0 when every key sits in its own bucket, probes add to it
+  bw_out_num(o, "reads_per_get", "\t%.3f\treads/get",
+             gets ? (double)get_reads / gets : NAN);
+  bw_out_num(o, "hit_ratio", "\t%.4f\thits", gets ? (double)hits / gets : NAN);
+  bw_out_num(o, "mputs", "\t%.4f\tMputs/s",
+             put_usec ? (double)keys / put_usec : NAN);
+  bw_out_end(o);
+}
+
+// Server side view of a step: the aggregate bandwidth and the receiver's cpu
+// cost. With several clients also the bandwidth of each client from the
+// step start to its last qp finishing, and Jain's fairness index
+// (sum x)^2 / (n * sum x^2), 1.0 when all clients got the same share.
+static void bw_report_server(struct bw_params *p, size_t bw_size) {
+  struct bw_out *o = p->out;
+  struct bw_stats st;
+  long long start_time = p->workers[0].start_time;
+  long long end_time = p->workers[0].end_time;
+  double sum = 0, sum_sq = 0;
+  size_t total_size = 0;
+  long long cpu_ns = 0;
+
+  for (int t = 0; t < p->num_threads; t++) {
+    start_time = MIN(start_time, p->workers[t].start_time);
+    end_time = MAX(end_time, p->workers[t].end_time);
+  }
+  for (int c = 0; c < p->num_clients; c++) {
+    long long client_end = start_time;
+    size_t client_size = 0;
+    double bw;
+
+    for (int q = c * p->qps_per_client; q < (c + 1) * p->qps_per_client;
+         q++) {
+      client_size += p->st[q].iters * bw_size;
+      client_end = MAX(client_end, p->st[q].end_time);
+    }
+    bw = client_end > start_time
+             ? (double)client_size / (client_end - start_time) / 1000.0
+             : 0.0;
+    p->client_bw[c] = bw;
+    sum += bw;
+    sum_sq += bw * bw;
+    total_size += client_size;
+  }
+  for (int t = 0; t < p->num_threads; t++)
+    cpu_ns += p->workers[t].cpu_ns;
+  if (!bw_trial_add(p, (double)total_size / (end_time - start_time) / 1000.0,
+                    &st))
+    return;
+  // receiver cpu per GiB; with --poll=busy it only tracks the wall time
+  bw_out_int(o, "size", "%lld", bw_size);
+  bw_out_num(o, "usec", NULL, end_time - start_time);
+  bw_out_num(o, "gib_per_s", "\t%.4f\tGiB/s", st.mean);
+  bw_out_stats(o, &st);
+  bw_out_num(o, "cpu_s_per_gib", "\t%.4f\tcpu-s/GiB",
+             (double)cpu_ns / total_size);
+  bw_out_verify(p, st.mean, cpu_ns);
+  if (p->num_clients > 1) {
+    bw_out_num(o, "fairness", "\t%.4f\tfairness",
+               sum_sq > 0 ? sum * sum / (p->num_clients * sum_sq) : 1.0);
+    for (int c = 0; c < p->num_clients; c++) {
+      char key[32];
+
+      snprintf(key, sizeof key, "client%d_gib_per_s", c);
+      bw_out_text(o, "\n\tclient%d", c);
+      bw_out_num(o, key, "\t%.4f\tGiB/s", p->client_bw[c]);
+    }
+  }
+  bw_out_end(o);
+}
+
+// bandwidth of one direction of a bidir step, up to its last qp finishing
+static double bw_bidir_rate(struct bw_stripe_state *st, int num_qps,
+                            long long start_time, size_t bw_size) {
+  long long end_time = start_time;
+  size_t total_size = 0;
+
+  for (int q = 0; q < num_qps; q++) {
+    total_size += st[q].iters * bw_size;
+    end_time = MAX(end_time, st[q].end_time);
+  }
+  return end_time > start_time
+             ? (double)total_size / (end_time - start_time) / 1000.0
+             : 0.0;
+}
+
+// sent, received and combined bandwidth of a bidir step, and the cpu of
+// driving both directions
+static void bw_report_bidir(struct bw_params *p, int num_qps,
+                            size_t bw_size) {
+  struct bw_out *o = p->out;
+  struct bw_stats st;
+  long long start_time = p->workers[0].start_time;
+  long long cpu_ns = 0;
+  double tx, rx;
+
+  for (int t = 0; t < p->num_threads; t++) {
+    start_time = MIN(start_time, p->workers[t].start_time);
+    cpu_ns += p->workers[t].cpu_ns;
+  }
+  tx = bw_bidir_rate(p->st, num_qps, start_time, bw_size);
+  rx = bw_bidir_rate(p->st_rx, num_qps, start_time, bw_size);
+  // the trials are compared by the combined rate
+  if (!bw_trial_add(p, tx + rx, &st))
+    return;
+  bw_out_int(o, "size", "%lld", bw_size);
+  bw_out_int(o, "iters", NULL, p->client_iters[0]);
+  bw_out_num(o, "tx_gib_per_s", "\t%.4f\ttx-GiB/s", tx);
+  bw_out_num(o, "rx_gib_per_s", "\t%.4f\trx-GiB/s", rx);
+  bw_out_num(o, "gib_per_s", "\t%.4f\tGiB/s", st.mean);
+  bw_out_stats(o, &st);
+  bw_out_num(o, "cpu_s_per_gib", "\t%.4f\tcpu-s/GiB",
+             (double)cpu_ns / (2 * (size_t)p->client_iters[0] * bw_size));
+  bw_out_end(o);
+}
+
+// a worker failing mid-sweep would leave the others blocked on the barrier,
+// so errors terminate the whole process.
+static void *bw_worker_main(void *arg) {
+  struct bw_worker *w = arg;
+  struct bw_params *p = w->params;
+
+  if (w->cpu >= 0 && bw_pin_thread(w->cpu)) {
+    fprintf(stderr, "Couldn't pin thread %d to cpu %d\n", w->id, w->cpu);
+    exit(1);
+  }
+
+  // reads and atomics keep the server's cpu out of the data path
+  int responder = p->op == BW_OP_READ || p->op == BW_OP_FADD ||
+                  p->op == BW_OP_CAS;
+  // sends are credited through the window pipeline
+  int two_sided = p->op == BW_OP_SEND || p->op == BW_OP_KV;
+
+  for (;;) {
+    size_t bw_size;
+    long long cpu_start;
+
+    // worker 0 agrees on the step with the peer while the others wait
+    if (w->id == 0) {
+      if (p->is_server ? bw_recv_step(p) : bw_send_step(p))
+        exit(1);
+      w->ctx->verify = !!(p->step_flags & BW_STEP_VERIFY);
+      if (p->op == BW_OP_CAS && !(p->step_flags & BW_STEP_END) &&
+          bw_cas_reset(p, w->ctx))
+        exit(1);
+      // every step PUTs its keys into an empty table
+      if (p->is_server && w->ctx->kv_buckets &&
+          !(p->step_flags & BW_STEP_END)) {
+        memset(w->ctx->bigbuf, 0, w->ctx->kv_buckets * BW_KV_LINE);
+        w->ctx->kv_used = 0;
+        w->ctx->kv_full = 0;
+      }
+    }
+    pthread_barrier_wait(&p->barrier);
+    if (p->step_flags & BW_STEP_END)
+      break;
+    bw_size = p->step_size;
+    if (p->bidir) { // both sides send and receive
+      cpu_start = bw_thread_cpu_ns();
+      if (bw_run_bidir(w, bw_size))
+        exit(1);
+      w->cpu_ns = bw_thread_cpu_ns() - cpu_start;
+      pthread_barrier_wait(&p->barrier);
+      if ((p->step_flags & BW_STEP_TRIAL) && w->id == 0)
+        bw_report_bidir(p, w->ctx->num_qps, bw_size);
+    } else if (!p->is_server) { // this is client
+      w->rtt_sum = 0;
+      w->rtt_count = 0;
+      w->cas_ok = 0;
+      w->sleeps = 0;
+      if (w->hist)
+        memset(w->hist, 0, sizeof *w->hist);
+      cpu_start = bw_thread_cpu_ns();
+      if (p->op == BW_OP_KV         ? bw_client_run_kv(w, bw_size)
+          : p->op == BW_OP_RING     ? bw_client_run_ring(w, bw_size)
+          : responder               ? bw_client_run_read(w, bw_size)
+          : p->window || two_sided  ? bw_client_run_window(w, bw_size)
+                                    : bw_client_run_size(w, bw_size))
+        exit(1);
+      w->cpu_ns = bw_thread_cpu_ns() - cpu_start;
+      pthread_barrier_wait(&p->barrier);
+      if ((p->step_flags & BW_STEP_TRIAL) && w->id == 0) {
+        if (p->op == BW_OP_KV)
+          bw_report_kv(p, bw_size);
+        else
+          bw_report_size(p, w->ctx->num_qps, bw_size);
+      }
+    } else { // this is server
+      cpu_start = bw_thread_cpu_ns();
+      if (p->op == BW_OP_RING       ? bw_server_run_ring(w)
+          : responder               ? bw_server_run_read(w)
+          : p->window || two_sided  ? bw_server_run_window(w)
+                                    : bw_server_run_size(w))
+        exit(1);
+      w->cpu_ns = bw_thread_cpu_ns() - cpu_start;
+      pthread_barrier_wait(&p->barrier);
+      if (w->id == 0 && w->ctx->kv_full)
+        fprintf(stderr, "%ld PUTs of %zu bytes found no room in the table\n",
+                w->ctx->kv_full, bw_size);
+      if ((p->step_flags & BW_STEP_TRIAL) && w->id == 0)
+        bw_report_server(p, bw_size);
+    }
+  }
+  return NULL;
+}
+
+// every parameter that shapes the results goes in front of them
+static void bw_record_params(struct bw_out *o, struct bw_params *p,
+                             const char *servername, struct ibv_device *dev,
+                             int ib_port, enum ibv_mtu mtu, int rx_depth,
+                             int inline_size, int rd_atomic, int lat_hist,
+                             int use_srq, enum bw_mem mem,
+                             enum bw_engine engine, int dev_node,
+                             int numa_node) {
+  bw_out_param(o, "role", 1, "%s", servername ? "client" : "server");
+  bw_out_param(o, "peer", 1, "%s", servername ? servername : "");
+  bw_out_param(o, "device", 1, "%s", ibv_get_device_name(dev));
+  bw_out_param(o, "ib_port", 0, "%d", ib_port);
+  bw_out_param(o, "mtu", 0, "%d", 128 << mtu);
+  bw_out_param(o, "op", 1, "%s", bw_op_names[p->op]);
+  bw_out_param(o, "sizes", 1, "%s", p->sizes_arg);
+  bw_out_param(o, "iters", 0, "%d", p->iters);
+  bw_out_param(o, "duration", 0, "%g", p->duration);
+  bw_out_param(o, "trials", 0, "%d", p->trials);
+  bw_out_param(o, "stable_pct", 0, "%g", p->stable * 100);
+  bw_out_param(o, "verify", 0, "%d", p->verify);
+  bw_out_param(o, "gather", 1, "%s", p->frags_arg ? p->frags_arg : "");
+  bw_out_param(o, "kv_keys", 1, "%s", p->kv_keys_arg ? p->kv_keys_arg : "");
+  bw_out_param(o, "qps", 0, "%d", p->qps_per_client);
+  bw_out_param(o, "threads", 0, "%d", p->num_threads);
+  bw_out_param(o, "clients", 0, "%d", p->num_clients);
+  bw_out_param(o, "tx_depth", 0, "%d", p->tx_depth);
+  bw_out_param(o, "rx_depth", 0, "%d", rx_depth);
+  bw_out_param(o, "batch", 0, "%d", p->batch);
+  bw_out_param(o, "signal", 0, "%d", p->signal_every);
+  bw_out_param(o, "inline", 0, "%d", inline_size);
+  bw_out_param(o, "window", 0, "%d", p->window);
+  bw_out_param(o, "rd_atomic", 0, "%d", rd_atomic);
+  bw_out_param(o, "atomic_words", 0, "%d", p->atomic_words);
+  bw_out_param(o, "poll", 1, "%s", bw_poll_names[p->poll_mode]);
+  bw_out_param(o, "poll_budget", 0, "%d", p->poll_budget);
+  bw_out_param(o, "lat_hist", 0, "%d", lat_hist);
+  bw_out_param(o, "srq", 0, "%d", use_srq);
+  bw_out_param(o, "mem", 1, "%s", bw_mem_names[mem]);
+  bw_out_param(o, "engine", 1, "%s", engine == BW_ENGINE_EX ? "ex" : "legacy");
+  bw_out_param(o, "bidir", 0, "%d", p->bidir);
+  bw_out_param(o, "device_numa_node", 0, "%d", dev_node);
+  bw_out_param(o, "numa_node", 0, "%d", numa_node);
 }
 
 int main(int argc, char *argv[]) {
   struct ibv_device **dev_list;
   struct ibv_device *ib_dev;
   struct bandwidth_context *ctx;
-  struct bandwidth_dest my_dest;
+  struct bandwidth_dest *my_dest;
   struct bandwidth_dest *rem_dest;
   char *ib_devname = NULL;
   char *servername = NULL; // modify it to NULL
@@ -623,11 +4657,58 @@ int main(int argc, char *argv[]) {
   int rx_depth = 100;
   int tx_depth = 100;
   int iters = 1000;
-  int use_event = 0;
+  int use_event;
   int size = 1;
-  int bm_max_size = 131072;
+  size_t bm_max_size = 0;
+  size_t *sizes = NULL;
+  int num_sizes = 0;
+  const char *sizes_arg = "1-131072";
+  size_t atomic_size = 8; // atomics always move 8 bytes, a single step
+  double duration = 0;
+  int trials = 1;
+  double stable = 2;
+  int numa_node = BW_NUMA_AUTO;
+  int dev_node;
+  int verify = 0;
+  size_t *frags = NULL;
+  int num_frags = 0;
+  const char *frags_arg = NULL;
+  int max_frags = 1;
+  size_t *kv_keys = NULL;
+  int num_kv_keys = 0;
+  const char *kv_keys_arg = "1k-16k";
+  size_t max_keys = 0;
+  size_t kv_size = 0;
+  enum bw_format format = BW_FMT_TEXT;
+  const char *format_names[] = {"text", "json", "csv"};
+  struct bw_out out = {0};
+  int *ctrl_fds;
   int sl = 0;
   int gidx = -1;
+  int num_qps = 1;
+  int num_threads = 1;
+  int *cpus = NULL;
+  int num_cpus = 0;
+  int batch = 1;
+  int signal_every = 1;
+  int inline_size = MAX_INLINE_SIZE;
+  int window = 0;
+  enum bw_op op = BW_OP_WRITE;
+  int rd_atomic = 0;
+  enum bw_poll_mode poll_mode = BW_POLL_BUSY;
+  int poll_budget = 100;
+  int lat_hist = 0;
+  int atomic_words = 1;
+  int bidir = 0;
+  int num_clients = 1;
+  int qps_per_client;
+  int conn_threads = 0;
+  enum bw_mem mem = BW_MEM_4K;
+  size_t reg_bench_max = 0;
+  long slab_bench_ops = 0;
+  enum bw_engine engine = BW_ENGINE_LEGACY;
+  uint64_t exch_start;
+  int use_srq = 0;
   char gid[33];
 
   srand48(getpid() * time(NULL));
@@ -646,9 +4727,42 @@ int main(int argc, char *argv[]) {
         {.name = "sl", .has_arg = 1, .val = 'l'},
         {.name = "events", .has_arg = 0, .val = 'e'},
         {.name = "gid-idx", .has_arg = 1, .val = 'g'},
+        {.name = "qps", .has_arg = 1, .val = 'q'},
+        {.name = "threads", .has_arg = 1, .val = 't'},
+        {.name = "cpus", .has_arg = 1, .val = 'c'},
+        {.name = "batch", .has_arg = 1, .val = 'b'},
+        {.name = "signal", .has_arg = 1, .val = 'S'},
+        {.name = "inline", .has_arg = 1, .val = 'I'},
+        {.name = "window", .has_arg = 1, .val = 'w'},
+        {.name = "op", .has_arg = 1, .val = 'o'},
+        {.name = "atomic-words", .has_arg = 1, .val = 'W'},
+        {.name = "rd-atomic", .has_arg = 1, .val = 'R'},
+        {.name = "poll", .has_arg = 1, .val = 'P'},
+        {.name = "poll-budget", .has_arg = 1, .val = 'B'},
+        {.name = "lat-hist", .has_arg = 0, .val = 'L'},
+        {.name = "clients", .has_arg = 1, .val = 'M'},
+        {.name = "srq", .has_arg = 0, .val = 'X'},
+        {.name = "connect-threads", .has_arg = 1, .val = 'C'},
+        {.name = "mem", .has_arg = 1, .val = 'H'},
+        {.name = "reg-bench", .has_arg = 1, .val = 'G'},
+        {.name = "slab-bench", .has_arg = 1, .val = 'A'},
+        {.name = "engine", .has_arg = 1, .val = 'E'},
+        {.name = "bidir", .has_arg = 0, .val = 'D'},
+        {.name = "sizes", .has_arg = 1, .val = 'z'},
+        {.name = "duration", .has_arg = 1, .val = 'T'},
+        {.name = "format", .has_arg = 1, .val = 'F'},
+        {.name = "trials", .has_arg = 1, .val = 'N'},
+        {.name = "stable", .has_arg = 1, .val = 'U'},
+        {.name = "numa", .has_arg = 1, .val = 'K'},
+        {.name = "verify", .has_arg = 0, .val = 'V'},
+        {.name = "gather", .has_arg = 1, .val = 'Y'},
+        {.name = "kv-keys", .has_arg = 1, .val = 'k'},
         {0}};
 
-    c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:", long_options, NULL);
+    c = getopt_long(argc, argv,
+                    "p:d:i:s:m:r:n:l:eg:q:t:c:b:S:I:w:o:W:R:P:B:L"
+                    "M:XC:H:G:A:E:Dz:T:F:N:U:K:VY:k:",
+                    long_options, NULL);
     if (c == -1)
       break;
 
@@ -699,13 +4813,280 @@ int main(int argc, char *argv[]) {
       break;
 
     case 'e':
-      ++use_event;
+      poll_mode = BW_POLL_EVENT;
+      break;
+
+    case 'P':
+      if (!strcmp(optarg, "busy"))
+        poll_mode = BW_POLL_BUSY;
+      else if (!strcmp(optarg, "event"))
+        poll_mode = BW_POLL_EVENT;
+      else if (!strcmp(optarg, "hybrid"))
+        poll_mode = BW_POLL_HYBRID;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'B':
+      poll_budget = strtol(optarg, NULL, 0);
+      if (poll_budget < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'L':
+      lat_hist = 1;
+      break;
+
+    case 'M':
+      num_clients = strtol(optarg, NULL, 0);
+      if (num_clients < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'X':
+      use_srq = 1;
+      break;
+
+    case 'C':
+      conn_threads = strtol(optarg, NULL, 0);
+      if (conn_threads < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'H':
+      for (mem = 0; mem < BW_MEM_NUM; mem++)
+        if (!strcmp(optarg, bw_mem_names[mem]))
+          break;
+      if (mem == BW_MEM_NUM) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'G':
+      reg_bench_max = strtoull(optarg, NULL, 0);
+      if (reg_bench_max < 4096) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'D':
+      bidir = 1;
+      break;
+
+    case 'z':
+      free(sizes);
+      num_sizes = bw_parse_sizes(optarg, &sizes);
+      sizes_arg = optarg;
+      if (num_sizes < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'T':
+      duration = strtod(optarg, NULL);
+      if (duration <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'N':
+      trials = strtol(optarg, NULL, 0);
+      if (trials < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'U':
+      stable = strtod(optarg, NULL);
+      if (stable < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'V':
+      verify = 1;
+      break;
+
+    case 'Y':
+      free(frags);
+      num_frags = bw_parse_sizes(optarg, &frags);
+      frags_arg = optarg;
+      if (num_frags < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      for (int i = 0; i < num_frags; i++)
+        max_frags = MAX(max_frags, (int)MIN(frags[i], INT_MAX));
+      if (max_frags > BW_GATHER_MAX) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'k':
+      free(kv_keys);
+      num_kv_keys = bw_parse_sizes(optarg, &kv_keys);
+      kv_keys_arg = optarg;
+      if (num_kv_keys < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'K':
+      if (!strcmp(optarg, "auto"))
+        numa_node = BW_NUMA_AUTO;
+      else if (!strcmp(optarg, "off"))
+        numa_node = -1;
+      else {
+        numa_node = strtol(optarg, NULL, 0);
+        if (numa_node < 0 || numa_node >= BW_NUMA_MAX) {
+          usage(argv[0]);
+          return 1;
+        }
+      }
+      break;
+
+    case 'F':
+      for (format = 0; format <= BW_FMT_CSV; format++)
+        if (!strcmp(optarg, format_names[format]))
+          break;
+      if (format > BW_FMT_CSV) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'E':
+      if (!strcmp(optarg, "legacy"))
+        engine = BW_ENGINE_LEGACY;
+      else if (!strcmp(optarg, "ex"))
+        engine = BW_ENGINE_EX;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'A':
+      slab_bench_ops = strtol(optarg, NULL, 0);
+      if (slab_bench_ops < 1) {
+        usage(argv[0]);
+        return 1;
+      }
       break;
 
     case 'g':
       gidx = strtol(optarg, NULL, 0);
       break;
 
+    case 'q':
+      num_qps = strtol(optarg, NULL, 0);
+      if (num_qps < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 't':
+      num_threads = strtol(optarg, NULL, 0);
+      if (num_threads < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'c':
+      num_cpus = bw_parse_cpus(optarg, &cpus);
+      if (num_cpus < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'b':
+      batch = strtol(optarg, NULL, 0);
+      if (batch < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'S':
+      signal_every = strtol(optarg, NULL, 0);
+      if (signal_every < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'I':
+      inline_size = strtol(optarg, NULL, 0);
+      if (inline_size < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'w':
+      window = strtol(optarg, NULL, 0);
+      if (window < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'o':
+      if (!strcmp(optarg, "write"))
+        op = BW_OP_WRITE;
+      else if (!strcmp(optarg, "read"))
+        op = BW_OP_READ;
+      else if (!strcmp(optarg, "fadd"))
+        op = BW_OP_FADD;
+      else if (!strcmp(optarg, "cas"))
+        op = BW_OP_CAS;
+      else if (!strcmp(optarg, "send"))
+        op = BW_OP_SEND;
+      else if (!strcmp(optarg, "ring"))
+        op = BW_OP_RING;
+      else if (!strcmp(optarg, "kv"))
+        op = BW_OP_KV;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'W':
+      atomic_words = strtol(optarg, NULL, 0);
+      if (atomic_words < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'R':
+      rd_atomic = strtol(optarg, NULL, 0);
+      if (rd_atomic < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
     default:
       usage(argv[0]);
       return 1;
@@ -720,6 +5101,90 @@ int main(int argc, char *argv[]) {
   }
 
   page_size = sysconf(_SC_PAGESIZE);
+  bw_info = format == BW_FMT_TEXT ? stdout : stderr;
+  out.fmt = format;
+  // the default sweep, the largest size sizes the buffers
+  if (!sizes) {
+    if (op == BW_OP_KV)
+      sizes_arg = "8-4k";
+    num_sizes = bw_parse_sizes(sizes_arg, &sizes);
+  }
+  if (num_sizes < 0)
+    return 1;
+  for (int i = 0; i < num_sizes; i++)
+    bm_max_size = MAX(bm_max_size, sizes[i]);
+  // both sides size the table for the most keys, so they hash alike
+  if (op == BW_OP_KV) {
+    if (!kv_keys && (num_kv_keys = bw_parse_sizes(kv_keys_arg, &kv_keys)) < 0)
+      return 1;
+    for (int i = 0; i < num_kv_keys; i++)
+      max_keys = MAX(max_keys, kv_keys[i]);
+  }
+  // a verified message needs room for its crc, smaller sizes are skipped
+  if (verify) {
+    int n = 0;
+    for (int i = 0; i < num_sizes; i++)
+      if (sizes[i] >= BW_VERIFY_MIN)
+        sizes[n++] = sizes[i];
+    num_sizes = n;
+    if (op != BW_OP_SEND || !num_sizes) {
+      fprintf(stderr, "--verify needs --op=send and sizes of at least %d\n",
+              BW_VERIFY_MIN);
+      return 1;
+    }
+  }
+  bw_crc32c_init();
+  ctrl_fds = malloc(num_clients * sizeof *ctrl_fds);
+  if (!ctrl_fds)
+    return 1;
+  for (int c = 0; c < num_clients; c++)
+    ctrl_fds[c] = -1;
+  if (!conn_threads)
+    conn_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  use_event = poll_mode != BW_POLL_BUSY;
+
+  // every thread owns at least one qp and a tx_depth * bm_max_size slice
+  if (num_qps < num_threads)
+    num_qps = num_threads;
+  qps_per_client = num_qps;
+  if (servername) {
+    num_clients = 1;
+    use_srq = 0;
+  } else {
+    num_qps *= num_clients;
+  }
+  // a chain or an unsignaled run longer than the send queue can't be posted
+  batch = MIN(batch, tx_depth);
+  signal_every = MIN(signal_every, tx_depth);
+  // a send needs a posted recv; the peer keeps rx_depth per qp, so more
+  // unacknowledged sends would stall in rnr retries
+  if (op == BW_OP_SEND || op == BW_OP_KV)
+    window = window ? MIN(window, rx_depth) : rx_depth;
+  // the server counts gathered messages like any others in window mode
+  if (frags && (op != BW_OP_WRITE || !window || bidir || !servername)) {
+    fprintf(stderr, "--gather needs --op=write and -w on the client\n");
+    return 1;
+  }
+  // ring records and their heads raise no cqes to sleep on
+  if (op == BW_OP_RING && (poll_mode != BW_POLL_BUSY || bidir)) {
+    fprintf(stderr, "--op=ring needs --poll=busy and no --bidir\n");
+    return 1;
+  }
+  // the table is filled and read by one client, a step at a time
+  if (op == BW_OP_KV && (duration > 0 || bidir || num_clients > 1)) {
+    fprintf(stderr, "--op=kv needs a single client and no --duration or "
+                    "--bidir\n");
+    return 1;
+  }
+  // bidir runs the window pipeline both ways on a single pair of peers
+  if (bidir) {
+    if (op != BW_OP_WRITE || num_clients > 1) {
+      fprintf(stderr, "--bidir needs --op=write and a single client\n");
+      return 1;
+    }
+    if (!window)
+      window = tx_depth;
+  }
 
   dev_list = ibv_get_device_list(NULL);
   if (!dev_list) {
@@ -745,120 +5210,287 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // Keep the buffers and the polling threads next to the device unless
+  // --numa names another node. Explicit --cpus still win for the threads.
+  dev_node = bw_dev_numa_node(ibv_get_device_name(ib_dev));
+  if (numa_node == BW_NUMA_AUTO)
+    numa_node = dev_node;
+  if (numa_node >= 0) {
+    if (!num_cpus && (num_cpus = bw_node_cpus(numa_node, &cpus)) < 0) {
+      fprintf(stderr, "Couldn't read the cpus of numa node %d\n", numa_node);
+      return 1;
+    }
+    if (bw_prefer_node(numa_node)) {
+      fprintf(stderr, "Couldn't prefer numa node %d: %s\n", numa_node,
+              strerror(errno));
+      return 1;
+    }
+  }
+  if (numa_node >= 0 || dev_node >= 0)
+    fprintf(bw_info, "numa\t%d\tdevice-node\t%d\tnode\t%d\tcpus\n",
+            dev_node, numa_node, num_cpus);
+
+  // the server's table: buckets, then a value slot per key
+  if (op == BW_OP_KV && !servername)
+    kv_size = bw_kv_buckets(max_keys) * BW_KV_LINE +
+              max_keys * roundup(bm_max_size, BW_KV_LINE);
   ctx = bw_init_ctx(ib_dev, size, rx_depth, tx_depth, ib_port, use_event,
-                    !servername, (size_t)tx_depth * bm_max_size);
+                    num_threads, !servername,
+                    MAX((size_t)tx_depth * bm_max_size * num_threads *
+                            (op == BW_OP_RING ? num_qps / qps_per_client : 1),
+                        kv_size),
+                    num_qps,
+                    inline_size, rd_atomic, use_srq, mem, engine, numa_node,
+                    max_frags);
   if (!ctx)
     return 1;
+  // more fragments than sges run as the most the device takes
+  if (frags) {
+    for (int i = 0; i < num_frags; i++)
+      frags[i] = MIN(frags[i], (size_t)ctx->max_send_sge);
+    fprintf(bw_info, "gather\t%d\tmax-sge\n", ctx->max_send_sge);
+  }
 
-  ctx->routs = bw_post_recv(ctx, ctx->rx_depth);
-  if (ctx->routs < ctx->rx_depth) {
-    fprintf(stderr, "Couldn't post receive (%d)\n", ctx->routs);
-    return 1;
+  if (reg_bench_max || slab_bench_ops) {
+    int ret = reg_bench_max ? bw_reg_bench(ctx, reg_bench_max)
+                            : bw_slab_bench(ctx, slab_bench_ops);
+    bw_close_ctx(ctx);
+    ibv_free_device_list(dev_list);
+    return ret;
+  }
+
+  if (op == BW_OP_FADD || op == BW_OP_CAS) {
+    if (!ctx->atomic_access) {
+      fprintf(stderr, "Device %s has no atomics\n",
+              ibv_get_device_name(ib_dev));
+      return 1;
+    }
+    if ((size_t)atomic_words * BW_ATOMIC_STRIDE > ctx->bigbuf_size) {
+      fprintf(stderr, "%d atomic words don't fit the %zu byte buffer\n",
+              atomic_words, ctx->bigbuf_size);
+      return 1;
+    }
+    // latency percentiles are part of every atomic result
+    lat_hist = 1;
   }
 
-  if (use_event)
-    if (ibv_req_notify_cq(ctx->cq, 0)) {
-      fprintf(stderr, "Couldn't request CQ notification\n");
+  int atomic = op == BW_OP_FADD || op == BW_OP_CAS;
+
+  // the server of send mode receives into a ring of rx_depth slots per rq,
+  // a PUT carries its key in front of the value
+  if (op == BW_OP_SEND && !servername && bw_init_rx_ring(ctx, bm_max_size))
+    return 1;
+  if (op == BW_OP_KV && !servername &&
+      bw_init_rx_ring(ctx, sizeof(uint64_t) + bm_max_size))
+    return 1;
+  if (op == BW_OP_KV)
+    ctx->kv_buckets = bw_kv_buckets(max_keys);
+
+  for (int q = 0; q < (ctx->srq ? 1 : num_qps); q++) {
+    uint32_t *slots = malloc(ctx->rx_depth * sizeof *slots);
+    if (!slots)
+      return 1;
+    for (int i = 0; i < ctx->rx_depth; i++)
+      slots[i] = q * ctx->rx_depth + i;
+    ctx->qps[q].routs = bw_post_recv(ctx, q, slots, ctx->rx_depth);
+    free(slots);
+    if (ctx->qps[q].routs < ctx->rx_depth) {
+      fprintf(stderr, "Couldn't post receive (%d)\n", ctx->qps[q].routs);
       return 1;
     }
+  }
+  if (!servername && (ctx->srq || num_clients > 1 || ctx->rx_ring)) {
+    long wrs = (long)ctx->rx_depth * (ctx->srq ? 1 : num_qps);
+    long wr_size = ctx->rx_ring ? (long)ctx->rx_slot_size : ctx->size;
+    fprintf(bw_info, "receive queues: %ld WRs of %ld bytes, %ld bytes (%s)\n",
+            wrs, wr_size, wrs * wr_size,
+            ctx->srq ? "one SRQ" : "one RQ per QP");
+  }
 
   if (bw_get_port_info(ctx->context, ib_port, &ctx->portinfo)) {
     fprintf(stderr, "Couldn't get port info\n");
     return 1;
   }
 
-  my_dest.lid = ctx->portinfo.lid;
-  if (ctx->portinfo.link_layer == IBV_LINK_LAYER_INFINIBAND && !my_dest.lid) {
+  my_dest = calloc(num_qps, sizeof *my_dest);
+  if (!my_dest)
+    return 1;
+
+  my_dest[0].lid = ctx->portinfo.lid;
+  if (ctx->portinfo.link_layer == IBV_LINK_LAYER_INFINIBAND &&
+      !my_dest[0].lid) {
     fprintf(stderr, "Couldn't get local LID\n");
     return 1;
   }
 
   if (gidx >= 0) {
-    if (ibv_query_gid(ctx->context, ib_port, gidx, &my_dest.gid)) {
+    if (ibv_query_gid(ctx->context, ib_port, gidx, &my_dest[0].gid)) {
       fprintf(stderr, "Could not get local gid for gid index %d\n", gidx);
       return 1;
     }
   } else
-    memset(&my_dest.gid, 0, sizeof my_dest.gid);
+    memset(&my_dest[0].gid, 0, sizeof my_dest[0].gid);
 
-  my_dest.qpn = ctx->qp->qp_num;
-  my_dest.psn = lrand48() & 0xffffff;
-  my_dest.buf_addr = (uint64_t)ctx->bigbuf;
-  my_dest.rkey = ctx->bigmr->rkey;
-  inet_ntop(AF_INET6, &my_dest.gid, gid, sizeof gid);
+  // --op=ring: every qp gets its own ring, the server's rings are as large
+  // as the client's since its bigbuf grows with the clients
+  if (op == BW_OP_RING) {
+    ctx->ring_bytes = ctx->bigbuf_size / num_qps / BW_RING_LINE * BW_RING_LINE;
+    if (ctx->ring_bytes < BW_RING_LINE + bw_ring_record(bm_max_size)) {
+      fprintf(stderr, "A ring of %zu bytes can't take a %zu byte record\n",
+              ctx->ring_bytes, bm_max_size);
+      return 1;
+    }
+  }
+  for (int q = 0; q < num_qps; q++) {
+    my_dest[q].lid = my_dest[0].lid;
+    my_dest[q].gid = my_dest[0].gid;
+    my_dest[q].qpn = ctx->qps[q].qp->qp_num;
+    my_dest[q].psn = lrand48() & 0xffffff;
+    my_dest[q].buf_addr = (uint64_t)ctx->bigbuf + q * ctx->ring_bytes;
+    my_dest[q].rkey = ctx->bigmr->rkey;
+    if (op == BW_OP_RING)
+      *bw_ring_head(ctx, &my_dest[q]) = 0;
+  }
+  inet_ntop(AF_INET6, &my_dest[0].gid, gid, sizeof gid);
 
+  exch_start = bw_now_ns();
   if (servername)
-    rem_dest = bw_client_exch_dest(servername, port, &my_dest);
+    rem_dest =
+        bw_client_exch_dest(servername, port, my_dest, num_qps, &ctrl_fds[0]);
   else
-    rem_dest = bw_server_exch_dest(ctx, ib_port, mtu, port, sl, &my_dest, gidx);
+    rem_dest = bw_server_exch_dest(ctx, ib_port, mtu, port, sl, my_dest, gidx,
+                                   num_clients, conn_threads, ctrl_fds);
 
   if (!rem_dest)
     return 1;
+  if (servername)
+    fprintf(bw_info, "exchange\t%d\tQPs\t%.1f\tusec\n", num_qps,
+            (bw_now_ns() - exch_start) / 1000.0);
 
   inet_ntop(AF_INET6, &rem_dest->gid, gid, sizeof gid);
 
-  if (servername)
-    if (bw_connect_ctx(ctx, ib_port, my_dest.psn, mtu, sl, rem_dest, gidx))
-      return 1;
-
-  if (servername) {   // this is client
-    int warmuped = 0; // warm up has the same iters with other tests
-    for (size_t bw_size = 1; bw_size <= bm_max_size;) {
-      long long start_time = getMicrotime();
-      int sended = 0;
-      while (sended < iters) {
-        int to_send = iters - sended < tx_depth ? iters - sended : tx_depth;
-        for (int i = 0; i < to_send; i++) {
-          size_t off = (size_t)i * bw_size;
-          int ret = bw_post_write(ctx, my_dest.buf_addr + off, bw_size,
-                                  rem_dest->buf_addr + off, rem_dest->rkey,
-                                  i + 1 == to_send, 1);
-          if (ret != 0) {
-            fprintf(stderr, "bw_post_write failed %d\n", ret);
-            return 1;
-          }
-        }
-        while (bw_wait_completions(ctx) <= 0) {
-          ;
-        }
-        sended += to_send;
-      }
-      long long end_time = getMicrotime();
-      size_t total_size = iters * bw_size;
-      if (!warmuped) {
-        warmuped = 1;
-      } else {
-        printf("%zu\t%.4f\tGiB/s\n", bw_size,
-               (double)total_size / (end_time - start_time) / 1000.0);
-        bw_size *= 2;
-      }
-    }
-  }
+  if (servername && bw_connect_all(ctx, 0, num_qps, ib_port, my_dest, mtu, sl,
+                                   rem_dest, gidx, conn_threads))
+    return 1;
+
+  {
+    struct bw_params params = {.iters = iters,
+                               .tx_depth = tx_depth,
+                               .batch = batch,
+                               .signal_every = signal_every,
+                               .window = window,
+                               .atomic_words = atomic_words,
+                               .op = op,
+                               .poll_mode = poll_mode,
+                               .poll_budget = poll_budget,
+                               .is_server = !servername,
+                               .num_clients = num_clients,
+                               .qps_per_client = qps_per_client,
+                               .bidir = bidir,
+                               .bm_max_size = bm_max_size,
+                               .sizes = atomic ? &atomic_size : sizes,
+                               .num_sizes = atomic ? 1 : num_sizes,
+                               .sizes_arg = atomic ? "8" : sizes_arg,
+                               .duration = duration,
+                               .trials = trials,
+                               .verify = verify,
+                               .frags = frags,
+                               .num_frags = num_frags,
+                               .frags_arg = frags_arg,
+                               .kv_keys = servername ? kv_keys : NULL,
+                               .num_kv_keys = num_kv_keys,
+                               .kv_keys_arg = op == BW_OP_KV ? kv_keys_arg
+                                                             : NULL,
+                               .stable = stable / 100,
+                               .warming = 1,
+                               .ctrl_fds = ctrl_fds,
+                               .out = &out,
+                               .num_threads = num_threads};
+    struct bw_worker *workers = calloc(num_threads, sizeof *workers);
+    params.st = calloc(num_qps, sizeof *params.st);
+    params.client_bw = calloc(num_clients, sizeof *params.client_bw);
+    params.st_rx = calloc(num_qps, sizeof *params.st_rx);
+    params.client_iters = calloc(num_clients, sizeof *params.client_iters);
+    if (!workers || !params.st || !params.client_bw || !params.st_rx ||
+        !params.client_iters)
+      return 1;
+    params.workers = workers;
+    pthread_barrier_init(&params.barrier, NULL, num_threads);
 
-  else {              // this is server
-    int warmuped = 0; // warm up has the same iters with other tests
-    for (size_t bw_size = 1; bw_size <= bm_max_size;) {
-      int received = 0;
-      while (received < iters) {
-        int ne = bw_wait_completions(ctx);
-        received += ne * tx_depth;
-        for (int i = 0; i < ne; i++) {
-          int ret = bw_post_send(ctx);
-          if (ret != 0) {
-            fprintf(stderr, "bw_post_send_with_imm failed %d\n", ret);
+    for (int t = 0; t < num_threads; t++) {
+      struct bw_worker *w = &workers[t];
+      w->params = &params;
+      w->ctx = ctx;
+      w->my_dest = my_dest;
+      w->rem_dest = rem_dest;
+      w->id = t;
+      // keep the old unpinned behaviour for a plain single-thread run
+      if (num_cpus > 0)
+        w->cpu = cpus[t % num_cpus];
+      else
+        w->cpu = num_threads > 1 ? t % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+      w->qp_begin = bw_qp_begin(num_qps, num_threads, t);
+      w->qp_end = bw_qp_begin(num_qps, num_threads, t + 1);
+      w->buf_len = ctx->bigbuf_size / num_threads;
+      w->buf_off = w->buf_len * t;
+      if (bw_chain_init(&w->chain, ctx, batch, signal_every))
+        return 1;
+      // latency is measured by the client only
+      if (lat_hist && servername) {
+        w->hist = calloc(1, sizeof *w->hist);
+        if (!w->hist)
+          return 1;
+        for (int q = w->qp_begin; q < w->qp_end; q++) {
+          ctx->qps[q].hist_ring = ctx->max_send_wr;
+          ctx->qps[q].post_ns =
+              calloc(ctx->max_send_wr, sizeof *ctx->qps[q].post_ns);
+          if (!ctx->qps[q].post_ns)
             return 1;
-          }
+          ctx->qps[q].hist = w->hist;
         }
       }
-      if (!warmuped) {
-        warmuped = 1;
-      } else {
-        bw_size *= 2;
+    }
+    // worker 0 runs on the main thread
+    for (int t = 1; t < num_threads; t++)
+      if (pthread_create(&workers[t].thread, NULL, bw_worker_main,
+                         &workers[t])) {
+        fprintf(stderr, "Couldn't create thread %d\n", t);
+        return 1;
       }
+    bw_record_params(&out, &params, servername, ib_dev, ib_port, mtu,
+                     rx_depth, inline_size, rd_atomic, lat_hist, use_srq, mem,
+                     engine, dev_node, numa_node);
+    bw_out_begin(&out);
+    bw_worker_main(&workers[0]);
+    for (int t = 1; t < num_threads; t++)
+      pthread_join(workers[t].thread, NULL);
+    bw_out_close(&out);
+
+    pthread_barrier_destroy(&params.barrier);
+    for (int t = 0; t < num_threads; t++) {
+      bw_chain_free(&workers[t].chain);
+      free(workers[t].hist);
     }
+    for (int q = 0; q < num_qps; q++)
+      free(ctx->qps[q].post_ns);
+    free(params.st);
+    free(params.client_bw);
+    free(params.st_rx);
+    free(params.client_iters);
+    free(params.trial_rate);
+    free(workers);
   }
 
+  for (int c = 0; c < num_clients; c++)
+    close(ctrl_fds[c]);
+  free(ctrl_fds);
+  free(sizes);
+  free(frags);
+  free(kv_keys);
+
   ibv_free_device_list(dev_list);
+  free(my_dest);
   free(rem_dest);
+  free(cpus);
   return 0;
 }
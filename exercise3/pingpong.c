@@ -1,12 +1,45 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <linux/mempolicy.h>
+#include <math.h>
 #include <mpi.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include <ucp/api/ucp.h>
 #include <ucs/type/status.h>
 
 #define BUFFER_SIZE (10LL * 1024 * 1024) // ucp_put_nbx/ucp_get_nbx max size
-#define ITERS (1000)
+#define ITERS (1000) // default of -n
+#define ATOMIC_STRIDE 64 // every target word on its own cache line
+#define WARMUP_MAX 16    // warmup runs before giving up on a stable rate
+#define NUMA_AUTO (-2)   // --numa default, the node of the device
+#define NUMA_MAX 256
+#define PONG_TAG 1       // --op=pingpong run announcements and their acks
+
+enum op_mode {
+  OP_PUT,  // ucp_put_nbx size sweep
+  OP_FADD, // 64-bit fetch-and-add of 1
+  OP_CAS,  // 64-bit compare-and-swap
+  OP_PINGPONG, // put, then wait for the peer's put back, one at a time
+};
+
+enum out_format {
+  FMT_TEXT, // tab-separated lines
+  FMT_JSON, // the parameters and one object per result
+  FMT_CSV,  // the parameters as comments, a header and one row per result
+};
+
+const char *op_names[] = {"put", "fadd", "cas", "pingpong"};
+const char *format_names[] = {"text", "json", "csv"};
 
 int mpi_rank;
 int mpi_size;
@@ -25,6 +58,23 @@ void *remote_rkey_buffer;       // remote rkey buffer
 size_t remote_rkey_buffer_size; // remote rkey_buffer_size
 
 int should_server_run = 1;
+enum op_mode op_mode = OP_PUT;
+int atomic_words = 1; // 1 is fully contended, more spread the ops
+uint64_t *word_seen;  // last value the client saw in each target word
+size_t *sizes;        // put sweep, default 8 to BUFFER_SIZE doubling
+int num_sizes;
+const char *sizes_arg = "8-8m";
+int iters = ITERS;    // per size, or per batch with a duration
+double duration;      // seconds per size, 0: a single batch of iters
+enum out_format out_format = FMT_TEXT;
+int records;          // results written
+int trials = 1;       // measured runs per size
+double stable = 0.02; // warm up until two runs agree this closely
+int numa_node = NUMA_AUTO;
+int dev_node = -1;    // numa node of the rdma device, -1 if unknown
+int port;             // --port: connect without MPI, 0: exchange over MPI
+const char *servername; // --port client: the server to connect to
+double connect_usec;  // client: from the start of the exchange to the rkey
 
 void send_callback(void *request, ucs_status_t status, void *user_data) {
   ucp_request_free(request); // ?
@@ -56,85 +106,901 @@ ucs_status_t blocking_ep_flush(ucp_ep_h ep, ucp_worker_h worker) {
   }
 }
 
-int client_function() {
+// Wait for a request returned by a nbx call, NULL means already done.
+ucs_status_t wait_request(ucs_status_ptr_t request) {
   ucs_status_t status;
 
-  // send client address
+  if (request == NULL)
+    return UCS_OK;
+  if (UCS_PTR_IS_ERR(request))
+    return UCS_PTR_STATUS(request);
+  do {
+    ucp_worker_progress(ucp_worker);
+    status = ucp_request_check_status(request);
+  } while (status == UCS_INPROGRESS);
+  ucp_request_free(request);
+  return status;
+}
+
+// seconds on a monotonic clock, MPI_Wtime needs MPI_Init
+double wtime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// q-quantile of n sorted samples
+double percentile(const double *sorted, int n, double q) {
+  int i = (int)(q * n);
+  return sorted[i < n ? i : n - 1];
+}
+
+// results of the trials of one size
+struct stats {
+  double mean;
+  double stddev;
+  double ci; // half width of the 95% confidence interval of the mean
+  double min, max;
+  int n, kept; // trials, and those left after dropping the outliers
+};
+
+// two-sided 95% quantiles of Student's t for 1..30 degrees of freedom
+const double t95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                      2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                      2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                      2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+
+// Mean, stddev and confidence interval of n trials, after dropping those
+// further than 3 scaled median absolute deviations from the median.
+void trial_stats(double *x, int n, struct stats *st) {
+  double dev[n];
+  double median, mad, sum = 0, sum_sq = 0;
+
+  qsort(x, n, sizeof(*x), compare_double);
+  median = percentile(x, n, 0.5);
+  for (int i = 0; i < n; i++)
+    dev[i] = fabs(x[i] - median);
+  qsort(dev, n, sizeof(*dev), compare_double);
+  mad = percentile(dev, n, 0.5);
+  st->n = n;
+  st->kept = 0;
+  st->min = x[n - 1];
+  st->max = x[0];
+  for (int i = 0; i < n; i++) {
+    // 1.4826 * mad estimates the stddev of normally distributed trials
+    if (mad > 0 && fabs(x[i] - median) > 3 * 1.4826 * mad)
+      continue;
+    st->kept++;
+    sum += x[i];
+    sum_sq += x[i] * x[i];
+    st->min = x[i] < st->min ? x[i] : st->min;
+    st->max = x[i] > st->max ? x[i] : st->max;
+  }
+  st->mean = sum / st->kept;
+  st->stddev = st->kept > 1 ? sqrt(fmax(sum_sq - sum * st->mean, 0.0) /
+                                   (st->kept - 1))
+                            : 0;
+  st->ci = st->kept > 1 ? (st->kept <= 31 ? t95[st->kept - 2] : 1.960) *
+                              st->stddev / sqrt(st->kept)
+                        : 0;
+}
+
+// text: the spread of the trials after the mean it describes
+void print_stats(const struct stats *st) {
+  if (st->n > 1)
+    printf("\t%.2f\tci95\t%.2f\tstddev\t%.2f\tmin\t%.2f\tmax\t%d/%d\ttrials",
+           st->ci, st->stddev, st->min, st->max, st->kept, st->n);
+}
+
+// Numa node of the rdma device UCX uses: the first one named by
+// UCX_NET_DEVICES (e.g. mlx5_0:1), or else the first one in sysfs.
+int device_numa_node() {
+  char name[64] = "", path[320];
+  const char *devices = getenv("UCX_NET_DEVICES");
+  int node = -1;
+  FILE *f;
+
+  if (devices && strcmp(devices, "all"))
+    sscanf(devices, "%63[^:,]", name);
+  if (!name[0]) {
+    DIR *dir = opendir("/sys/class/infiniband");
+    struct dirent *d;
+    while (dir && (d = readdir(dir)))
+      if (d->d_name[0] != '.') {
+        snprintf(name, sizeof(name), "%.63s", d->d_name);
+        break;
+      }
+    if (dir)
+      closedir(dir);
+  }
+  if (!name[0])
+    return -1;
+  snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node",
+           name);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  if (fscanf(f, "%d", &node) != 1)
+    node = -1;
+  fclose(f);
+  return node;
+}
+
+// Run the process on the cpus of node and prefer it for later allocations.
+int bind_process(int node) {
+  unsigned long mask[NUMA_MAX / (8 * sizeof(unsigned long))] = {0};
+  char path[64], list[4096];
+  char *p = list, *end;
+  cpu_set_t set;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  if (!fgets(list, sizeof(list), f)) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  CPU_ZERO(&set);
+  // "0-7,16-23"
+  while (*p && *p != '\n') {
+    long lo = strtol(p, &end, 10), hi = lo;
+    if (end == p)
+      return -1;
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    for (long c = lo; c <= hi; c++)
+      CPU_SET(c, &set);
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (sched_setaffinity(0, sizeof(set), &set))
+    return -1;
+  mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX);
+}
+
+// Place [buf, buf + len) on node. MPOL_BIND doesn't fall back to another
+// node, so a forced cross-socket run really is one.
+int bind_buffer(void *buf, size_t len, int node) {
+  unsigned long mask[NUMA_MAX / (8 * sizeof(unsigned long))] = {0};
+
+  mask[node / (8 * sizeof(*mask))] |= 1UL << (node % (8 * sizeof(*mask)));
+  return syscall(SYS_mbind, buf, len, MPOL_BIND, mask, NUMA_MAX,
+                 MPOL_MF_MOVE);
+}
+
+// a size with an optional k, m or g suffix
+int parse_size(const char *p, char **end, size_t *size) {
+  unsigned long long v = strtoull(p, end, 0);
+
+  if (*end == p)
+    return -1;
+  switch (**end) {
+  case 'k':
+  case 'K':
+    v <<= 10;
+    (*end)++;
+    break;
+  case 'm':
+  case 'M':
+    v <<= 20;
+    (*end)++;
+    break;
+  case 'g':
+  case 'G':
+    v <<= 30;
+    (*end)++;
+    break;
+  }
+  *size = v;
+  return v ? 0 : -1;
+}
+
+// Parse "64,4k-1m,8k-64k+8k" into sizes, return the count or -1. A range
+// doubles from its start, or adds the step after a '+'.
+int parse_sizes(const char *list, size_t **out) {
+  int n = 0, cap = 32;
+  const char *p = list;
+
+  *out = malloc(cap * sizeof(**out));
+  if (!*out)
+    return -1;
+  while (*p) {
+    char *end;
+    size_t lo, hi, step = 0;
+    if (parse_size(p, &end, &lo))
+      goto err;
+    hi = lo;
+    if (*end == '-') {
+      if (parse_size(end + 1, &end, &hi) || hi < lo)
+        goto err;
+      if (*end == '+' && parse_size(end + 1, &end, &step))
+        goto err;
+    }
+    for (size_t size = lo; size <= hi; size = step ? size + step : size * 2) {
+      if (n == cap) {
+        size_t *tmp = realloc(*out, (cap *= 2) * sizeof(**out));
+        if (!tmp)
+          goto err;
+        *out = tmp;
+      }
+      (*out)[n++] = size;
+      if (size > hi - (step ? step : size)) // the next one would pass hi
+        break;
+    }
+    if (*end == ',')
+      end++;
+    else if (*end)
+      goto err;
+    p = end;
+  }
+  if (n > 0)
+    return n;
+err:
+  free(*out);
+  *out = NULL;
+  return -1;
+}
+
+// the run's parameters, once before the first result; text only shows the
+// numa placement
+void print_params() {
+  const char *keys[] = {"op",         "words",      "sizes",
+                        "iters",      "duration",   "trials",
+                        "stable_pct", "numa_node", "device_numa_node",
+                        "bootstrap",  "connect_usec"};
+  char vals[11][64];
+
+  if (out_format == FMT_TEXT) {
+    if (numa_node >= 0 || dev_node >= 0)
+      printf("numa\t%d\tdevice-node\t%d\tnode\n", dev_node, numa_node);
+    printf("connect\t%.1f\tusec\t%s\n", connect_usec,
+           port ? "sockaddr" : "mpi");
+    return;
+  }
+  snprintf(vals[0], sizeof(vals[0]), "%s", op_names[op_mode]);
+  snprintf(vals[1], sizeof(vals[1]), "%d", atomic_words);
+  snprintf(vals[2], sizeof(vals[2]), "%s", sizes_arg);
+  snprintf(vals[3], sizeof(vals[3]), "%d", iters);
+  snprintf(vals[4], sizeof(vals[4]), "%g", duration);
+  snprintf(vals[5], sizeof(vals[5]), "%d", trials);
+  snprintf(vals[6], sizeof(vals[6]), "%g", stable * 100);
+  snprintf(vals[7], sizeof(vals[7]), "%d", numa_node);
+  snprintf(vals[8], sizeof(vals[8]), "%d", dev_node);
+  snprintf(vals[9], sizeof(vals[9]), "%s", port ? "sockaddr" : "mpi");
+  snprintf(vals[10], sizeof(vals[10]), "%.1f", connect_usec);
+  if (out_format == FMT_CSV) {
+    for (int i = 0; i < 11; i++)
+      printf("# %s=%s\n", keys[i], vals[i]);
+    return;
+  }
+  printf("{\"params\":{");
+  for (int i = 0; i < 11; i++) {
+    // op, sizes and bootstrap
+    const char *quote = i == 0 || i == 2 || i == 9 ? "\"" : "";
+    printf("%s\"%s\":%s%s%s", i ? "," : "", keys[i], quote, vals[i], quote);
+  }
+  printf("},\n\"results\":[");
+}
+
+// json/csv: one flat record of n named values
+void print_record(const char *const *keys, const double *vals, int n) {
+  if (out_format == FMT_CSV && records == 0)
+    for (int i = 0; i < n; i++)
+      printf("%s%s", keys[i], i + 1 < n ? "," : "\n");
+  if (out_format == FMT_JSON)
+    printf("%s\n{", records ? "," : "");
+  for (int i = 0; i < n; i++) {
+    if (out_format == FMT_JSON)
+      printf("%s\"%s\":%.10g", i ? "," : "", keys[i], vals[i]);
+    else
+      printf("%s%.10g", i ? "," : "", vals[i]);
+  }
+  printf(out_format == FMT_JSON ? "}" : "\n");
+  records++;
+}
+
+// One fadd/cas on word i % atomic_words of the remote buffer. A cas
+// expects the last value seen in the word and stores the next one, so it
+// fails whenever another op moved the word since.
+ucs_status_ptr_t post_atomic(ucp_ep_h ep, ucp_rkey_h rkey, int i,
+                             uint64_t *value, uint64_t *reply) {
+  ucp_request_param_t param;
+  int word = i % atomic_words;
+  uint64_t remote_addr = remote_buffer + (uint64_t)word * ATOMIC_STRIDE;
+
+  memset(&param, 0, sizeof(param));
+  param.op_attr_mask =
+      UCP_OP_ATTR_FIELD_DATATYPE | UCP_OP_ATTR_FIELD_REPLY_BUFFER;
+  param.datatype = ucp_dt_make_contig(sizeof(uint64_t));
+  param.reply_buffer = reply;
+  if (op_mode == OP_FADD) {
+    *value = 1;
+    return ucp_atomic_op_nbx(ep, UCP_ATOMIC_OP_ADD, value, 1, remote_addr,
+                             rkey, &param);
+  }
+  *reply = word_seen[word]; // compare value, replaced by the old value
+  *value = *reply + 1;
+  return ucp_atomic_op_nbx(ep, UCP_ATOMIC_OP_CSWAP, value, 1, remote_addr,
+                           rkey, &param);
+}
+
+// account a completed cas, returns 1 if it failed
+int complete_cas(int i, uint64_t value, uint64_t old) {
+  int failed = old + 1 != value;
+
+  word_seen[i % atomic_words] = failed ? old : value;
+  return failed;
+}
+
+// iters atomics one at a time for the latency percentiles, then trials
+// passes of iters outstanding at once for the throughput.
+int atomic_function(ucp_ep_h ep, ucp_rkey_h rkey) {
+  uint64_t *values, *replies;
+  double *lat;
+  ucs_status_ptr_t request;
+  ucs_status_t status;
+  double start_time, end_time;
+  double mops[trials];
+  struct stats st;
+  int cas_failed = 0;
+
+  word_seen = calloc(atomic_words, sizeof(*word_seen));
+  values = malloc(iters * sizeof(*values));
+  replies = malloc(iters * sizeof(*replies));
+  lat = malloc(iters * sizeof(*lat));
+  if (!word_seen || !values || !replies || !lat)
+    return 1;
+
+  // the first pass is the warmup
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < iters; i++) {
+      double t0 = wtime();
+      status = wait_request(post_atomic(ep, rkey, i, &values[i], &replies[i]));
+      if (status != UCS_OK) {
+        fprintf(stderr, "ucp_atomic_op_nbx failed\n");
+        return 1;
+      }
+      lat[i] = (wtime() - t0) * 1000000.0;
+      if (op_mode == OP_CAS)
+        complete_cas(i, values[i], replies[i]);
+    }
+  }
+  qsort(lat, iters, sizeof(lat[0]), compare_double);
+
+  // every trial is one pipelined pass
+  for (int t = 0; t < trials; t++) {
+    start_time = wtime();
+    for (int i = 0; i < iters; i++) {
+      request = post_atomic(ep, rkey, i, &values[i], &replies[i]);
+      if (UCS_PTR_IS_ERR(request)) {
+        fprintf(stderr, "ucp_atomic_op_nbx failed\n");
+        return 1;
+      }
+      if (request != NULL)
+        ucp_request_free(request);
+    }
+    status = blocking_ep_flush(ep, ucp_worker);
+    if (status != UCS_OK) {
+      fprintf(stderr, "blocking_ep_flush failed\n");
+      return 1;
+    }
+    end_time = wtime();
+    mops[t] = iters / (end_time - start_time) / 1000000.0;
+    // all of them were posted against the values seen before the pass
+    if (op_mode == OP_CAS)
+      for (int i = 0; i < iters; i++)
+        cas_failed += complete_cas(i, values[i], replies[i]);
+  }
+  trial_stats(mops, trials, &st);
+
+  if (out_format == FMT_TEXT) {
+    printf("%s\t%d\twords\t%.4f\tMops/s", op_names[op_mode], atomic_words,
+           st.mean);
+    print_stats(&st);
+    printf("\tp50 %.2f\tp99 %.2f\tp99.9 %.2f\tmax %.2f\tmicroseconds",
+           percentile(lat, iters, 0.50), percentile(lat, iters, 0.99),
+           percentile(lat, iters, 0.999), lat[iters - 1]);
+    if (op_mode == OP_CAS)
+      printf("\t%d\tcas-failed", cas_failed);
+    printf("\n");
+  } else {
+    const char *keys[] = {"words",     "p50_usec",  "p99_usec", "p999_usec",
+                          "max_usec",  "mops",      "ci95",     "stddev",
+                          "min",       "max",       "trials_kept",
+                          "trials",    "cas_failed"};
+    double vals[] = {atomic_words,
+                     percentile(lat, iters, 0.50),
+                     percentile(lat, iters, 0.99),
+                     percentile(lat, iters, 0.999),
+                     lat[iters - 1],
+                     st.mean,
+                     st.ci,
+                     st.stddev,
+                     st.min,
+                     st.max,
+                     st.kept,
+                     st.n,
+                     cas_failed};
+    print_record(keys, vals, op_mode == OP_CAS ? 13 : 12);
+  }
+  free(word_seen);
+  free(values);
+  free(replies);
+  free(lat);
+  return 0;
+}
+
+// Put size bytes iters times and flush, repeated until min_time seconds
+// have passed. Returns the seconds taken, or -1.
+double put_run(ucp_ep_h ep, ucp_rkey_h rkey, size_t size, double min_time,
+               long *done) {
+  ucp_request_param_t request_param;
+  ucs_status_ptr_t status_ptr;
+  ucs_status_t status;
+  double start_time = wtime();
+  double end_time;
+
+  memset(&request_param, 0, sizeof(request_param));
+  *done = 0;
+  do {
+    for (int i = 0; i < iters; i++) {
+      status_ptr = ucp_put_nbx(ep, my_buffer, size, remote_buffer, rkey,
+                               &request_param);
+      if (UCS_PTR_STATUS(status_ptr) == UCS_INPROGRESS) {
+        ucp_request_free(status_ptr); //  releases the non-blocking request
+        // back
+        //  to the library and continue handling
+      } else if (UCS_PTR_IS_ERR(status_ptr)) {
+        fprintf(stderr, "ucp_put_nbx failed\n");
+        return -1;
+      }
+    }
+    status = blocking_ep_flush(ep, ucp_worker);
+    if (status != UCS_OK) {
+      fprintf(stderr, "blocking_ep_flush failed\n");
+      return -1;
+    }
+    *done += iters;
+    end_time = wtime();
+  } while (end_time - start_time < min_time);
+  return end_time - start_time;
+}
+
+// Warm up on the first size until two runs agree within stable, then run
+// every size trials times, for iters puts or for duration seconds each.
+int put_sweep(ucp_ep_h ep, ucp_rkey_h rkey) {
+  double usec[trials];
+  double prev = 0;
+  struct stats st;
+  long done;
+
+  for (int w = 0; w < WARMUP_MAX; w++) {
+    double t = put_run(ep, rkey, sizes[0], 0, &done);
+    if (t < 0)
+      return 1;
+    if (stable <= 0 || (w > 0 && fabs(done / t - prev) <= stable * prev))
+      break;
+    prev = done / t;
+  }
+  for (int s = 0; s < num_sizes; s++) {
+    size_t size = sizes[s];
+    for (int t = 0; t < trials; t++) {
+      double time = put_run(ep, rkey, size, duration, &done);
+      if (time < 0)
+        return 1;
+      usec[t] = time * 1000000.0 / done;
+    }
+    trial_stats(usec, trials, &st);
+    if (out_format == FMT_TEXT) {
+      printf("%zu\t%.2f\tmicroseconds", size, st.mean);
+      print_stats(&st);
+      printf("\n");
+    } else {
+      const char *keys[] = {"size", "iters", "usec", "mb_per_s", "ci95",
+                            "stddev", "min", "max", "trials_kept", "trials"};
+      double vals[] = {size,      done,   st.mean, size / st.mean, st.ci,
+                       st.stddev, st.min, st.max,  st.kept,        st.n};
+      print_record(keys, vals, trials > 1 ? 10 : 4);
+    }
+  }
+  return 0;
+}
+
+// Send the worker address, rkey and buffer of this rank to peer.
+void mpi_send_info(int peer) {
   uint64_t tmp_buf = (uint64_t)my_buffer;
-  MPI_Send(&address_length, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD);
-  MPI_Send(address, address_length, MPI_BYTE, 1, 0, MPI_COMM_WORLD);
-  MPI_Send(&rkey_buffer_size, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD);
-  MPI_Send(rkey_buffer, rkey_buffer_size, MPI_BYTE, 1, 0, MPI_COMM_WORLD);
-  MPI_Send(&tmp_buf, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD);
-  // get server address
-  MPI_Recv(&remote_address_length, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
+  MPI_Send(&address_length, 1, MPI_UNSIGNED_LONG, peer, 0, MPI_COMM_WORLD);
+  MPI_Send(address, address_length, MPI_BYTE, peer, 0, MPI_COMM_WORLD);
+  MPI_Send(&rkey_buffer_size, 1, MPI_UNSIGNED_LONG, peer, 0, MPI_COMM_WORLD);
+  MPI_Send(rkey_buffer, rkey_buffer_size, MPI_BYTE, peer, 0, MPI_COMM_WORLD);
+  MPI_Send(&tmp_buf, 1, MPI_UNSIGNED_LONG, peer, 0, MPI_COMM_WORLD);
+}
+
+// Receive those of peer.
+void mpi_recv_info(int peer) {
+  MPI_Recv(&remote_address_length, 1, MPI_UNSIGNED_LONG, peer, 0,
+           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
   remote_address = (ucp_address_t *)malloc(remote_address_length);
-  MPI_Recv(remote_address, remote_address_length, MPI_BYTE, 1, 0,
+  MPI_Recv(remote_address, remote_address_length, MPI_BYTE, peer, 0,
+           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Recv(&remote_rkey_buffer_size, 1, MPI_UNSIGNED_LONG, peer, 0,
            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  MPI_Recv(&remote_rkey_buffer_size, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
   remote_rkey_buffer = malloc(remote_rkey_buffer_size);
-  MPI_Recv(remote_rkey_buffer, remote_rkey_buffer_size, MPI_BYTE, 1, 0,
+  MPI_Recv(remote_rkey_buffer, remote_rkey_buffer_size, MPI_BYTE, peer, 0,
            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  MPI_Recv(&remote_buffer, 1, MPI_UNSIGNED_LONG, 1, 0, MPI_COMM_WORLD,
+  MPI_Recv(&remote_buffer, 1, MPI_UNSIGNED_LONG, peer, 0, MPI_COMM_WORLD,
            MPI_STATUS_IGNORE);
+}
 
-  // create ep
-  ucp_ep_h ep;
+// Exchange with the other rank over MPI, the client sends first, and
+// connect to its worker address.
+int mpi_connect(ucp_ep_h *ep) {
   ucp_ep_params_t ep_params;
+  int peer = 1 - mpi_rank;
+
+  if (mpi_rank == 0) {
+    mpi_send_info(peer);
+    mpi_recv_info(peer);
+  } else {
+    mpi_recv_info(peer);
+    mpi_send_info(peer);
+  }
   memset(&ep_params, 0, sizeof(ep_params));
   ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
   ep_params.address = remote_address;
-  status = ucp_ep_create(ucp_worker, &ep_params, &ep);
-  if (status != UCS_OK) {
+  if (ucp_ep_create(ucp_worker, &ep_params, ep) != UCS_OK) {
     fprintf(stderr, "ucp_ep_create failed\n");
     return 1;
   }
+  return 0;
+}
 
-  // unpack remote rkey
-  ucp_rkey_h remote_rkey;
-  status = ucp_ep_rkey_unpack(ep, remote_rkey_buffer, &remote_rkey);
+// --port: the one stream message each side sends once connected, followed
+// by rkey_size bytes of packed rkey
+struct boot_info {
+  uint64_t buffer;
+  uint64_t rkey_size;
+};
+
+// blocking receive of exactly len bytes of the peer's stream
+ucs_status_t stream_recv(ucp_ep_h ep, void *buf, size_t len) {
+  ucp_request_param_t param;
+  size_t received;
+
+  memset(&param, 0, sizeof(param));
+  param.op_attr_mask = UCP_OP_ATTR_FIELD_FLAGS;
+  param.flags = UCP_STREAM_RECV_FLAG_WAITALL;
+  return wait_request(ucp_stream_recv_nbx(ep, buf, len, &received, &param));
+}
+
+void listener_conn_cb(ucp_conn_request_h conn_request, void *arg) {
+  *(ucp_conn_request_h *)arg = conn_request;
+}
+
+// Without MPI the server listens on --port and takes the first connection
+// request, the client connects to servername:port. Both then send their
+// buffer address and packed rkey as one stream message and read the peer's.
+int sock_connect(ucp_ep_h *ep) {
+  struct boot_info info = {.buffer = (uint64_t)my_buffer,
+                           .rkey_size = rkey_buffer_size};
+  ucp_ep_params_t ep_params;
+  ucp_request_param_t param;
+  ucs_status_t status;
+  char *msg;
+
+  memset(&ep_params, 0, sizeof(ep_params));
+  if (servername) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    char service[8];
+
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(servername, service, &hints, &res)) {
+      fprintf(stderr, "Couldn't resolve %s\n", servername);
+      return 1;
+    }
+    ep_params.field_mask =
+        UCP_EP_PARAM_FIELD_FLAGS | UCP_EP_PARAM_FIELD_SOCK_ADDR;
+    ep_params.flags = UCP_EP_PARAMS_FLAGS_CLIENT_SERVER;
+    ep_params.sockaddr.addr = res->ai_addr;
+    ep_params.sockaddr.addrlen = res->ai_addrlen;
+    status = ucp_ep_create(ucp_worker, &ep_params, ep);
+    freeaddrinfo(res);
+  } else {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_ANY),
+                               .sin_port = htons(port)};
+    ucp_listener_params_t listener_params;
+    ucp_conn_request_h conn_request = NULL;
+    ucp_listener_h listener;
+
+    memset(&listener_params, 0, sizeof(listener_params));
+    listener_params.field_mask = UCP_LISTENER_PARAM_FIELD_SOCK_ADDR |
+                                 UCP_LISTENER_PARAM_FIELD_CONN_HANDLER;
+    listener_params.sockaddr.addr = (const struct sockaddr *)&addr;
+    listener_params.sockaddr.addrlen = sizeof(addr);
+    listener_params.conn_handler.cb = listener_conn_cb;
+    listener_params.conn_handler.arg = &conn_request;
+    if (ucp_listener_create(ucp_worker, &listener_params, &listener) !=
+        UCS_OK) {
+      fprintf(stderr, "ucp_listener_create failed on port %d\n", port);
+      return 1;
+    }
+    while (!conn_request)
+      ucp_worker_progress(ucp_worker);
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_CONN_REQUEST;
+    ep_params.conn_request = conn_request;
+    status = ucp_ep_create(ucp_worker, &ep_params, ep);
+    ucp_listener_destroy(listener); // a single client
+  }
   if (status != UCS_OK) {
-    fprintf(stderr, "ucp_ep_rkey_unpack failed\n");
+    fprintf(stderr, "ucp_ep_create failed\n");
     return 1;
   }
 
-  // Send data to server
-  ucp_request_param_t request_param;
-  memset(&request_param, 0, sizeof(request_param));
+  msg = malloc(sizeof(info) + rkey_buffer_size);
+  if (!msg)
+    return 1;
+  memcpy(msg, &info, sizeof(info));
+  memcpy(msg + sizeof(info), rkey_buffer, rkey_buffer_size);
+  memset(&param, 0, sizeof(param));
+  status = wait_request(ucp_stream_send_nbx(
+      *ep, msg, sizeof(info) + rkey_buffer_size, &param));
+  free(msg);
+  if (status != UCS_OK || stream_recv(*ep, &info, sizeof(info)) != UCS_OK) {
+    fprintf(stderr, "Couldn't exchange the buffer and rkey\n");
+    return 1;
+  }
+  remote_buffer = info.buffer;
+  remote_rkey_buffer_size = info.rkey_size;
+  remote_rkey_buffer = malloc(remote_rkey_buffer_size);
+  if (!remote_rkey_buffer ||
+      stream_recv(*ep, remote_rkey_buffer, remote_rkey_buffer_size) !=
+          UCS_OK) {
+    fprintf(stderr, "Couldn't receive the rkey\n");
+    return 1;
+  }
+  return 0;
+}
 
-  ucs_status_ptr_t status_ptr;
-  int warmuped = 0;
-  for (size_t size = 8; size <= BUFFER_SIZE;) {
-    double start_time = MPI_Wtime();
-    for (int i = 0; i < ITERS; i++) {
-      status_ptr = ucp_put_nbx(ep, my_buffer, size, remote_buffer, remote_rkey,
-                               &request_param);
-      if (UCS_PTR_STATUS(status_ptr) == UCS_INPROGRESS) {
-        ucp_request_free(status_ptr); //  releases the non-blocking request
-        // back
-        //  to the library and continue handling
-      } else if (UCS_PTR_IS_ERR(status_ptr)) {
-        fprintf(stderr, "ucp_put_nbx failed\n");
-        return 1;
-      }
+// --op=pingpong: the client announces every run of rounds round trips of
+// size bytes, 0 rounds end the sweep
+struct pong_run {
+  uint64_t size;
+  uint64_t rounds;
+};
+
+// blocking tagged send and receive of the pingpong control messages
+ucs_status_t pong_send(ucp_ep_h ep, void *buf, size_t len) {
+  ucp_request_param_t param;
+
+  memset(&param, 0, sizeof(param));
+  return wait_request(ucp_tag_send_nbx(ep, buf, len, PONG_TAG, &param));
+}
+
+ucs_status_t pong_recv(void *buf, size_t len) {
+  ucp_request_param_t param;
+
+  memset(&param, 0, sizeof(param));
+  return wait_request(
+      ucp_tag_recv_nbx(ucp_worker, buf, len, PONG_TAG, -1, &param));
+}
+
+// one put of my_buffer + off into the peer's buffer at the same offset
+int pong_put_at(ucp_ep_h ep, ucp_rkey_h rkey, size_t off, size_t len) {
+  ucp_request_param_t param;
+  ucs_status_ptr_t request;
+
+  memset(&param, 0, sizeof(param));
+  request = ucp_put_nbx(ep, my_buffer + off, len, remote_buffer + off, rkey,
+                        &param);
+  if (UCS_PTR_IS_ERR(request)) {
+    fprintf(stderr, "ucp_put_nbx failed\n");
+    return 1;
+  }
+  if (request != NULL)
+    ucp_request_free(request);
+  return 0;
+}
+
+// Put the first size bytes of my_buffer, whose last byte is marker, into
+// the peer's buffer. ucp_put_nbx doesn't promise to place a message in
+// address order, so the marker byte goes in a put of its own behind a
+// ucp_worker_fence: once the peer sees it, the rest has landed. The peer
+// answers only after that, so the source is free again by the reply.
+int pong_put(ucp_ep_h ep, ucp_rkey_h rkey, size_t size, uint8_t marker) {
+  my_buffer[size - 1] = marker;
+  if (size > 1) {
+    if (pong_put_at(ep, rkey, 0, size - 1))
+      return 1;
+    if (ucp_worker_fence(ucp_worker) != UCS_OK) {
+      fprintf(stderr, "ucp_worker_fence failed\n");
+      return 1;
     }
-    status = blocking_ep_flush(ep, ucp_worker);
-    if (status != UCS_OK) {
-      fprintf(stderr, "blocking_ep_flush failed\n");
+  }
+  return pong_put_at(ep, rkey, size - 1, 1);
+}
+
+// Spin until the peer's marker put brings marker into the last byte of the
+// first size bytes of my_buffer, the fenced payload is there by then.
+void pong_wait(size_t size, uint8_t marker) {
+  volatile uint8_t *last = (volatile uint8_t *)my_buffer + size - 1;
+
+  while (*last != marker)
+    ucp_worker_progress(ucp_worker);
+}
+
+// One run of rounds round trips. The client's markers are odd and the
+// server's even, so neither side mistakes its own last put for the answer.
+// As uint8_t they wrap every 128 rounds, which is harmless: a side only
+// waits for the very next marker, and the byte it watches holds either its
+// own last marker or the cleared 0, both of the other parity.
+// The server clears its byte before the ack, stale data of an earlier size
+// can't end a wait early. lat gets the usec of every round trip.
+int pong_run(ucp_ep_h ep, ucp_rkey_h rkey, size_t size, int rounds,
+             double *lat) {
+  struct pong_run run = {.size = size, .rounds = rounds};
+  uint64_t ack;
+
+  if (pong_send(ep, &run, sizeof(run)) != UCS_OK ||
+      pong_recv(&ack, sizeof(ack)) != UCS_OK) {
+    fprintf(stderr, "pingpong run announcement failed\n");
+    return 1;
+  }
+  for (int r = 0; r < rounds; r++) {
+    double t0 = wtime();
+    if (pong_put(ep, rkey, size, 2 * r + 1))
+      return 1;
+    pong_wait(size, 2 * r + 2);
+    lat[r] = (wtime() - t0) * 1000000.0;
+  }
+  return 0;
+}
+
+// Server side: answer every announced run until the one without rounds.
+int pong_serve(ucp_ep_h ep, ucp_rkey_h rkey) {
+  struct pong_run run;
+  uint64_t ack = 0;
+
+  for (;;) {
+    if (pong_recv(&run, sizeof(run)) != UCS_OK) {
+      fprintf(stderr, "pingpong run announcement failed\n");
+      return 1;
+    }
+    if (run.rounds == 0)
+      return 0;
+    if (run.size == 0 || run.size > BUFFER_SIZE) {
+      fprintf(stderr, "pingpong size %llu is out of range\n",
+              (unsigned long long)run.size);
       return 1;
     }
-    double end_time = MPI_Wtime();
+    my_buffer[run.size - 1] = 0;
+    if (pong_send(ep, &ack, sizeof(ack)) != UCS_OK) {
+      fprintf(stderr, "pingpong ack failed\n");
+      return 1;
+    }
+    for (uint64_t r = 0; r < run.rounds; r++) {
+      pong_wait(run.size, 2 * r + 1);
+      if (pong_put(ep, rkey, run.size, 2 * r + 2))
+        return 1;
+    }
+  }
+}
+
+// Warm up on the first size until two runs agree within stable, then run
+// every size trials times for iters round trips. The mean is over the
+// trials, the percentiles over all round trips of the size.
+int pingpong_sweep(ucp_ep_h ep, ucp_rkey_h rkey) {
+  double *lat = malloc((size_t)trials * iters * sizeof(*lat));
+  double usec[trials];
+  double prev = 0;
+  struct pong_run end = {0};
+  struct stats st;
+  int ret = 1;
 
-    if (!warmuped) {
-      warmuped = 1;
+  if (!lat)
+    return 1;
+  for (int w = 0; w < WARMUP_MAX; w++) {
+    double sum = 0;
+    if (pong_run(ep, rkey, sizes[0], iters, lat))
+      goto out;
+    for (int i = 0; i < iters; i++)
+      sum += lat[i];
+    if (stable <= 0 || (w > 0 && fabs(sum / iters - prev) <= stable * prev))
+      break;
+    prev = sum / iters;
+  }
+  for (int s = 0; s < num_sizes; s++) {
+    size_t size = sizes[s];
+    long n = (long)trials * iters;
+    for (int t = 0; t < trials; t++) {
+      double *l = lat + (long)t * iters;
+      double sum = 0;
+      if (pong_run(ep, rkey, size, iters, l))
+        goto out;
+      for (int i = 0; i < iters; i++)
+        sum += l[i];
+      usec[t] = sum / iters;
+    }
+    trial_stats(usec, trials, &st);
+    qsort(lat, n, sizeof(lat[0]), compare_double);
+    if (out_format == FMT_TEXT) {
+      printf("%zu\t%.2f\trtt-usec", size, st.mean);
+      print_stats(&st);
+      printf("\tp50 %.2f\tp99 %.2f\tp99.9 %.2f\tmax %.2f\tmicroseconds\n",
+             percentile(lat, n, 0.50), percentile(lat, n, 0.99),
+             percentile(lat, n, 0.999), lat[n - 1]);
     } else {
-      printf("%zu\t%.2f\tmicroseconds\n", size,
-             (end_time - start_time) * 1000000.0 / ITERS);
-      size *= 2;
+      const char *keys[] = {"size",     "iters",     "rtt_usec",
+                            "p50_usec", "p99_usec",  "p999_usec",
+                            "max_usec", "ci95",      "stddev",
+                            "min",      "max",       "trials_kept",
+                            "trials"};
+      double vals[] = {size,
+                       n,
+                       st.mean,
+                       percentile(lat, n, 0.50),
+                       percentile(lat, n, 0.99),
+                       percentile(lat, n, 0.999),
+                       lat[n - 1],
+                       st.ci,
+                       st.stddev,
+                       st.min,
+                       st.max,
+                       st.kept,
+                       st.n};
+      print_record(keys, vals, trials > 1 ? 13 : 7);
     }
   }
+  if (pong_send(ep, &end, sizeof(end)) != UCS_OK) {
+    fprintf(stderr, "pingpong end failed\n");
+    goto out;
+  }
+  ret = 0;
+out:
+  free(lat);
+  return ret;
+}
+
+int client_function() {
+  ucs_status_t status;
+
+  // connect to the server, timed until its rkey is usable
+  double start_time = wtime();
+  ucp_ep_h ep;
+  if (port ? sock_connect(&ep) : mpi_connect(&ep))
+    return 1;
+
+  // unpack remote rkey
+  ucp_rkey_h remote_rkey;
+  status = ucp_ep_rkey_unpack(ep, remote_rkey_buffer, &remote_rkey);
+  if (status != UCS_OK) {
+    fprintf(stderr, "ucp_ep_rkey_unpack failed\n");
+    return 1;
+  }
+  connect_usec = (wtime() - start_time) * 1000000.0;
+
+  // Send data to server
+  print_params();
+  if ((op_mode == OP_FADD || op_mode == OP_CAS) &&
+      atomic_function(ep, remote_rkey) != 0)
+    return 1;
+  if (op_mode == OP_PUT && put_sweep(ep, remote_rkey) != 0)
+    return 1;
+  if (op_mode == OP_PINGPONG && pingpong_sweep(ep, remote_rkey) != 0)
+    return 1;
+  if (out_format == FMT_JSON)
+    printf("\n]}\n");
   // send end signal
   {
     char end_signal[] = "END";
@@ -143,8 +1009,12 @@ int client_function() {
     // send_param.op_attr_mask = UCP_OP_ATTR_FIELD_REQUEST;
     // send_param.request = NULL;
 
-    status_ptr =
-        ucp_tag_send_nbx(ep, end_signal, sizeof(end_signal), 0, &send_param);
+    status = wait_request(
+        ucp_tag_send_nbx(ep, end_signal, sizeof(end_signal), 0, &send_param));
+    if (status != UCS_OK) {
+      fprintf(stderr, "ucp_tag_send_nbx failed\n");
+      return 1;
+    }
     status = blocking_ep_flush(ep, ucp_worker);
     if (status != UCS_OK) {
       fprintf(stderr, "blocking_ep_flush failed\n");
@@ -152,7 +1022,8 @@ int client_function() {
     }
   }
 
-  MPI_Barrier(MPI_COMM_WORLD);
+  if (!port)
+    MPI_Barrier(MPI_COMM_WORLD);
 
   // Cleanup
   ucp_ep_destroy(ep);
@@ -165,37 +1036,20 @@ int client_function() {
 int server_function() {
   ucs_status_t status;
 
-  // get client address
-  MPI_Recv(&remote_address_length, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
-  remote_address = (ucp_address_t *)malloc(remote_address_length);
-  MPI_Recv(remote_address, remote_address_length, MPI_BYTE, 0, 0,
-           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  MPI_Recv(&remote_rkey_buffer_size, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
-  remote_rkey_buffer = malloc(remote_rkey_buffer_size);
-  MPI_Recv(remote_rkey_buffer, remote_rkey_buffer_size, MPI_BYTE, 0, 0,
-           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  MPI_Recv(&remote_buffer, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
-  // send server address
-  uint64_t tmp_buf = (uint64_t)my_buffer;
-  MPI_Send(&address_length, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD);
-  MPI_Send(address, address_length, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
-  MPI_Send(&rkey_buffer_size, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD);
-  MPI_Send(rkey_buffer, rkey_buffer_size, MPI_BYTE, 0, 0, MPI_COMM_WORLD);
-  MPI_Send(&tmp_buf, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD);
-
-  // create ep
   ucp_ep_h ep;
-  ucp_ep_params_t ep_params;
-  memset(&ep_params, 0, sizeof(ep_params));
-  ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
-  ep_params.address = remote_address;
-  status = ucp_ep_create(ucp_worker, &ep_params, &ep);
-  if (status != UCS_OK) {
-    fprintf(stderr, "ucp_ep_create failed\n");
+  if (port ? sock_connect(&ep) : mpi_connect(&ep))
     return 1;
+
+  // the pingpong server puts back into the client's buffer
+  ucp_rkey_h remote_rkey = NULL;
+  if (op_mode == OP_PINGPONG) {
+    status = ucp_ep_rkey_unpack(ep, remote_rkey_buffer, &remote_rkey);
+    if (status != UCS_OK) {
+      fprintf(stderr, "ucp_ep_rkey_unpack failed\n");
+      return 1;
+    }
+    if (pong_serve(ep, remote_rkey) != 0)
+      return 1;
   }
 
   // loop until received tag_send
@@ -218,36 +1072,222 @@ int server_function() {
     }
   }
 
-  MPI_Barrier(MPI_COMM_WORLD);
+  if (!port)
+    MPI_Barrier(MPI_COMM_WORLD);
 
   // Cleanup
   ucp_ep_destroy(ep);
-  // ucp_rkey_destroy(remote_rkey);
+  if (remote_rkey)
+    ucp_rkey_destroy(remote_rkey);
   free(remote_address);
   free(remote_rkey_buffer);
   return 0;
 }
 
+void usage(const char *argv0) {
+  printf("Usage: mpirun -np 2 %s [options]\n", argv0);
+  printf("       %s -p <port> [options]             (server, without MPI)\n",
+         argv0);
+  printf("       %s -p <port> [options] <server>    (client, without MPI)\n",
+         argv0);
+  printf("  -o, --op=<put|fadd|cas|pingpong> operation to measure (default "
+         "put)\n");
+  printf("  -w, --words=<num>       words targeted by fadd/cas, 1 is fully "
+         "contended (default 1)\n");
+  printf("  -z, --sizes=<list>      put sizes, e.g. 64,4k-1m,8k-64k+8k "
+         "(default 8-8m)\n");
+  printf("  -n, --iters=<num>       operations per size (default %d)\n",
+         ITERS);
+  printf("  -T, --duration=<sec>    repeat each size's puts for <sec> "
+         "seconds\n");
+  printf("  -F, --format=text|json|csv result format (default text)\n");
+  printf("  -K, --numa=auto|off|<node> run and allocate on the device's "
+         "node, anywhere or\n"
+         "                          on <node> (default auto)\n");
+  printf("  -N, --trials=<num>      measured runs per size, reported as mean, "
+         "ci95, stddev,\n"
+         "                          min and max (default 1)\n");
+  printf("  -U, --stable=<pct>      warm up until two runs agree within "
+         "<pct>%%, 0: one run\n"
+         "                          (default 2)\n");
+  printf("  -p, --port=<port>       connect through a UCX listener on <port> "
+         "instead of MPI\n");
+}
+
 int main(int argc, char **argv) {
-  MPI_Init(&argc, &argv);
+  while (1) {
+    static struct option long_options[] = {
+        {.name = "op", .has_arg = 1, .val = 'o'},
+        {.name = "words", .has_arg = 1, .val = 'w'},
+        {.name = "sizes", .has_arg = 1, .val = 'z'},
+        {.name = "iters", .has_arg = 1, .val = 'n'},
+        {.name = "duration", .has_arg = 1, .val = 'T'},
+        {.name = "format", .has_arg = 1, .val = 'F'},
+        {.name = "trials", .has_arg = 1, .val = 'N'},
+        {.name = "stable", .has_arg = 1, .val = 'U'},
+        {.name = "numa", .has_arg = 1, .val = 'K'},
+        {.name = "port", .has_arg = 1, .val = 'p'},
+        {0}};
+    int c =
+        getopt_long(argc, argv, "o:w:z:n:T:F:N:U:K:p:", long_options, NULL);
+
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'o':
+      if (!strcmp(optarg, "put"))
+        op_mode = OP_PUT;
+      else if (!strcmp(optarg, "fadd"))
+        op_mode = OP_FADD;
+      else if (!strcmp(optarg, "cas"))
+        op_mode = OP_CAS;
+      else if (!strcmp(optarg, "pingpong"))
+        op_mode = OP_PINGPONG;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'w':
+      atomic_words = strtol(optarg, NULL, 0);
+      if (atomic_words < 1 ||
+          (long long)atomic_words * ATOMIC_STRIDE > BUFFER_SIZE) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'z':
+      sizes_arg = optarg;
+      break;
+
+    case 'n':
+      iters = strtol(optarg, NULL, 0);
+      if (iters < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'T':
+      duration = strtod(optarg, NULL);
+      if (duration <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'N':
+      trials = strtol(optarg, NULL, 0);
+      if (trials < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'U':
+      stable = strtod(optarg, NULL) / 100;
+      if (stable < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    case 'K':
+      if (!strcmp(optarg, "auto"))
+        numa_node = NUMA_AUTO;
+      else if (!strcmp(optarg, "off"))
+        numa_node = -1;
+      else {
+        numa_node = strtol(optarg, NULL, 0);
+        if (numa_node < 0 || numa_node >= NUMA_MAX) {
+          usage(argv[0]);
+          return 1;
+        }
+      }
+      break;
+
+    case 'p':
+      port = strtol(optarg, NULL, 0);
+      if (port < 1 || port > 65535) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
 
-  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
-  if (mpi_size != 2) {
-    fprintf(stderr, "mpi_size should be 2! current %d\n", mpi_size);
+    case 'F':
+      for (out_format = FMT_TEXT; out_format <= FMT_CSV; out_format++)
+        if (!strcmp(optarg, format_names[out_format]))
+          break;
+      if (out_format > FMT_CSV) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (port && optind == argc - 1)
+    servername = argv[optind];
+  else if (optind < argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  // a pingpong run is a fixed number of round trips
+  if (op_mode == OP_PINGPONG && duration > 0) {
+    fprintf(stderr, "--duration only applies to --op=put\n");
+    return 1;
+  }
+  num_sizes = parse_sizes(sizes_arg, &sizes);
+  if (num_sizes < 0) {
+    usage(argv[0]);
     return 1;
   }
+  for (int i = 0; i < num_sizes; i++)
+    if (sizes[i] > BUFFER_SIZE) {
+      fprintf(stderr, "size %zu is above the %lld byte buffer\n", sizes[i],
+              BUFFER_SIZE);
+      return 1;
+    }
+
+  // without MPI the role comes from the command line
+  if (!port) {
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+    if (mpi_size != 2) {
+      fprintf(stderr, "mpi_size should be 2! current %d\n", mpi_size);
+      return 1;
+    }
+  } else {
+    mpi_rank = servername ? 0 : 1;
+  }
 
   ucs_status_t status;
 
+  // before ucp_init, so the worker's queues also land on the node
+  dev_node = device_numa_node();
+  if (numa_node == NUMA_AUTO)
+    numa_node = dev_node;
+  if (numa_node >= 0 && bind_process(numa_node)) {
+    fprintf(stderr, "Couldn't bind to numa node %d\n", numa_node);
+    return 1;
+  }
+
   // init ucp_context
 
   ucp_params_t ucp_params;
   memset(&ucp_params, 0, sizeof(ucp_params));
   ucp_params.field_mask = UCP_PARAM_FIELD_FEATURES;
   ucp_params.features =
-      UCP_FEATURE_RMA |
+      UCP_FEATURE_RMA | UCP_FEATURE_AMO64 |
       UCP_FEATURE_TAG; // exercise 3 only need RMA. tag match for stop
+  if (port) // the buffer and rkey go over a stream without MPI
+    ucp_params.features |= UCP_FEATURE_STREAM;
   ucp_config_t *config;
   status = ucp_config_read(NULL, NULL, &config);
   if (status != UCS_OK) {
@@ -272,12 +1312,22 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  // get address for later exchange
-  // when not in mpi, we can try ucp_listener_t
+  // get address for later exchange over MPI, --port uses a ucp_listener
   ucp_worker_get_address(ucp_worker, &address, &address_length);
 
   // allocate buffer and register
-  my_buffer = (char *)malloc(BUFFER_SIZE);
+  // page aligned, mbind works on whole pages
+  if (posix_memalign((void **)&my_buffer, sysconf(_SC_PAGESIZE),
+                     BUFFER_SIZE)) {
+    fprintf(stderr, "Couldn't allocate the buffer\n");
+    return 1;
+  }
+  if (numa_node >= 0 && bind_buffer(my_buffer, BUFFER_SIZE, numa_node)) {
+    fprintf(stderr, "Couldn't bind the buffer to numa node %d: %s\n",
+            numa_node, strerror(errno));
+    return 1;
+  }
+  memset(my_buffer, 0, BUFFER_SIZE); // atomic target words start at 0
   ucp_mem_map_params_t mem_map_params;
   memset(&mem_map_params, 0, sizeof(mem_map_params));
   mem_map_params.field_mask =
@@ -315,10 +1365,12 @@ int main(int argc, char **argv) {
   ucp_worker_release_address(ucp_worker, address);
   ucp_mem_unmap(ucp_context, memh);
   free(my_buffer);
+  free(sizes);
 
   ucp_worker_destroy(ucp_worker);
   ucp_cleanup(ucp_context);
 
-  MPI_Finalize();
+  if (!port)
+    MPI_Finalize();
   return 0;
 }